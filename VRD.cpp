@@ -1,9 +1,17 @@
 /*=================================================================
  * VRD.cpp - Compute Variance Ridge Detector on LAB images
  *
- * Input:   LAB-uint8 image, radius of edge detection
+ * Input:   LAB-uint8 image, radius of edge detection, and optionally
+ *          exact (default false)
  * Output:  2D array of edge magnitudes
  *
+ * By default the image is copied to a float LABX image and blurred with
+ * the engine set by setBlurEngineSSE(), IntegralImage unless changed.
+ * With exact set, the uint8 planes are blurred in place with exact
+ * integer sums instead. That path always mirrors the borders as the
+ * PaddedIntegral engine does, so the border values differ from the
+ * default, as well as the rounding.
+ *
  * Copyright 2012 Randolph Voorhies
  *	
  *=================================================================*/
@@ -14,8 +22,8 @@
 void mexFunction( int nlhs, mxArray *plhs[],
                   int nrhs, const mxArray *prhs[])
 {
-  if(nrhs != 2)
-    mexErrMsgTxt("Inputs must be [imagearray, radius]");
+  if(nrhs != 2 && nrhs != 3)
+    mexErrMsgTxt("Inputs must be [imagearray, radius] or [imagearray, radius, exact]");
   if(! (nlhs == 1 || nlhs == 3) )
     mexErrMsgTxt("VRD provides either one output ([magnitude], or three outputs [magnitude, horizontal, vertical]");
 
@@ -33,20 +41,28 @@ void mexFunction( int nlhs, mxArray *plhs[],
   // Get the desired radius
   int radius  = mxGetScalar(prhs[1]);
 
-  // Get the input array
-  uint8_t * mxInput = static_cast<uint8_t*>(mxGetData(prhs[0]));
+  // Get whether to blur the uint8 planes directly, with mirrored borders
+  bool const exact = (nrhs == 3) && mxIsLogicalScalarTrue(prhs[2]);
 
-  // Pack the input pixels into a LABx configuration
-  float * const img = static_cast<float*>(calloc(dims[0]*dims[1]*4, sizeof(float)));
+  // Get the input array
+  uint8_t const * const mxInput = static_cast<uint8_t const*>(mxGetData(prhs[0]));
   int const npixels = dims[0] * dims[1];
-  for(int i=0; i<3; ++i)
+
+  // Pack the input pixels into a LABx configuration, unless the integer blur reads the planes directly
+  float * img = NULL;
+  if(!exact)
   {
-    float *imgit = img + i;
-    for(int j=0; j<npixels; ++j)
+    img = static_cast<float*>(calloc(npixels*4, sizeof(float)));
+    for(int i=0; i<3; ++i)
     {
-      *imgit = *mxInput;
-      mxInput += 1;
-      imgit   += 4;
+      uint8_t const * planeit = mxInput + i*npixels;
+      float *imgit = img + i;
+      for(int j=0; j<npixels; ++j)
+      {
+        *imgit = *planeit;
+        planeit += 1;
+        imgit   += 4;
+      }
     }
   }
 
@@ -54,7 +70,10 @@ void mexFunction( int nlhs, mxArray *plhs[],
   if(nlhs == 1)
   {
     mxArray *mxOutput = mxCreateNumericArray(2, &dims[0], mxSINGLE_CLASS, mxComplexity(0));
-    vrd_sse(img, dims[0], dims[1], radius, static_cast<float*>(mxGetData(mxOutput)));
+    if(exact)
+      vrd_sse(mxInput, dims[0], dims[1], radius, static_cast<float*>(mxGetData(mxOutput)));
+    else
+      vrd_sse(img, dims[0], dims[1], radius, static_cast<float*>(mxGetData(mxOutput)));
     plhs[0] = mxOutput;
   }
   else
@@ -64,12 +83,14 @@ void mexFunction( int nlhs, mxArray *plhs[],
     mxArray *mxGradH  = mxCreateNumericArray(2, &dims[0], mxSINGLE_CLASS, mxComplexity(0));
 
     // Do the VRDing
-    vrd_sse(img, dims[0], dims[1], radius, static_cast<float*>(mxGetData(mxOutput)), static_cast<float*>(mxGetData(mxGradV)), static_cast<float*>(mxGetData(mxGradH)));
+    if(exact)
+      vrd_sse(mxInput, dims[0], dims[1], radius, static_cast<float*>(mxGetData(mxOutput)), static_cast<float*>(mxGetData(mxGradV)), static_cast<float*>(mxGetData(mxGradH)));
+    else
+      vrd_sse(img, dims[0], dims[1], radius, static_cast<float*>(mxGetData(mxOutput)), static_cast<float*>(mxGetData(mxGradV)), static_cast<float*>(mxGetData(mxGradH)));
     plhs[0] = mxOutput;
     plhs[1] = mxGradV;
     plhs[2] = mxGradH;
   }
 
-
   free(img);
 }
@@ -0,0 +1,508 @@
+/*=================================================================
+ * bench.cpp - Microbenchmarks for the SSE Variance Ridge Detector
+ *
+ * Usage:   ./bench [runs]
+ * Output:  Milliseconds per call for each case, averaged over runs
+ *
+ *=================================================================*/
+#include "vrd_sse.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+//! Fill an aligned w*h*4 LABX buffer with noise in the 0-255 range
+static float * makeInput(int const w, int const h)
+{
+  float * const img = static_cast<float*>(aligned_alloc(16, sizeof(float) * w * h * 4));
+  for (int i = 0; i < w*h*4; ++i)
+    img[i] = (i % 4 == 3) ? 0.0F : float(rand() % 256);
+  return img;
+}
+
+//! Copy the L, a and b channels of a LABX buffer into three uint8 planes
+static std::vector<uint8_t> makePlanarInput(float const * const img, int const w, int const h)
+{
+  std::vector<uint8_t> planes(w*h*3);
+  for (int i = 0; i < w*h; ++i)
+    for (int c = 0; c < 3; ++c)
+      planes[i + c*w*h] = uint8_t(img[4*i + c]);
+  return planes;
+}
+
+//! Average the runtime of blurredVarianceSSE() over runs calls, in milliseconds
+static double timeBlur(BlurEngine const engine, float const * const img, int const w, int const h, int const r,
+    float * output, int const runs)
+{
+  setBlurEngineSSE(engine);
+  blurredVarianceSSE(img, w, h, r, output);
+
+  std::chrono::high_resolution_clock::time_point const start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < runs; ++i)
+    blurredVarianceSSE(img, w, h, r, output);
+  std::chrono::high_resolution_clock::time_point const end = std::chrono::high_resolution_clock::now();
+
+  return std::chrono::duration<double, std::milli>(end - start).count() / runs;
+}
+
+//! Average the runtime of func() over runs calls, in milliseconds
+template<class Func>
+static double timeCall(Func func, int const runs)
+{
+  func();
+
+  std::chrono::high_resolution_clock::time_point const start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < runs; ++i)
+    func();
+  std::chrono::high_resolution_clock::time_point const end = std::chrono::high_resolution_clock::now();
+
+  return std::chrono::duration<double, std::milli>(end - start).count() / runs;
+}
+
+int main(int argc, char const ** argv)
+{
+  int const runs = (argc > 1) ? atoi(argv[1]) : 20;
+
+  // small images, where the corner and edge loops are a large part of the work, and large radii
+  int const cases[][3] = { {64, 48, 3}, {160, 120, 3}, {160, 120, 16}, {640, 480, 3}, {640, 480, 16},
+                           {640, 480, 32}, {1920, 1080, 5}, {1920, 1080, 32} };
+
+  printf("Blur engines, ms per call (%d runs, %d threads)\n", runs, getNumThreadsSSE());
+  printf("%12s %4s %10s %10s %10s %10s\n", "size", "r", "integral", "rolling", "padded", "uint8");
+  for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c)
+  {
+    int const w = cases[c][0];
+    int const h = cases[c][1];
+    int const r = cases[c][2];
+
+    float * const img = makeInput(w, h);
+    std::vector<float> output(w*h);
+
+    double const integral = timeBlur(BlurEngine::IntegralImage, img, w, h, r, &output[0], runs);
+    double const rolling  = timeBlur(BlurEngine::Rolling, img, w, h, r, &output[0], runs);
+    double const padded   = timeBlur(BlurEngine::PaddedIntegral, img, w, h, r, &output[0], runs);
+
+    std::vector<uint8_t> const planes = makePlanarInput(img, w, h);
+    double const uint8    = timeCall([&]() { blurredVarianceSSE(&planes[0], w, h, r, &output[0]); }, runs);
+
+    char size[32];
+    sprintf(size, "%dx%d", w, h);
+    printf("%12s %4d %10.3f %10.3f %10.3f %10.3f\n", size, r, integral, rolling, padded, uint8);
+
+    free(img);
+  }
+
+  // every stage at each instruction set level the CPU supports
+  setBlurEngineSSE(BlurEngine::IntegralImage);
+  IsaLevel const maxLevel = getIsaLevelSSE();
+  char const * const levelNames[] = { "sse", "avx2", "avx512" };
+  int const sizes[][2] = { {640, 480}, {1920, 1080} };
+
+  printf("\nStages by instruction set, ms per call (r = 5)\n");
+  printf("%12s %8s %10s %10s %10s\n", "size", "isa", "blur", "gradient", "ridge");
+  for (size_t c = 0; c < sizeof(sizes)/sizeof(sizes[0]); ++c)
+  {
+    int const w = sizes[c][0];
+    int const h = sizes[c][1];
+    int const r = 5;
+
+    float * const img = makeInput(w, h);
+    std::vector<float> blurred(w*h), gradX(w*h), gradY(w*h), ridge(w*h);
+
+    for (int level = 0; level <= int(maxLevel); ++level)
+    {
+      setIsaLevelSSE(IsaLevel(level));
+
+      double const blur = timeCall([&]() { blurredVarianceSSE(img, w, h, r, &blurred[0]); }, runs);
+      double const grad = timeCall([&]() { calculateGradientSSE(&blurred[0], w, h, r, &gradX[0], &gradY[0]); }, runs);
+      double const rdg  = timeCall([&]() { calculateRidgeSSE(&gradX[0], &gradY[0], w, h, r, &ridge[0]); }, runs);
+
+      char size[32];
+      sprintf(size, "%dx%d", w, h);
+      printf("%12s %8s %10.3f %10.3f %10.3f\n", size, levelNames[level], blur, grad, rdg);
+    }
+    setIsaLevelSSE(maxLevel);
+
+    free(img);
+  }
+
+  // the gradient, ridge and non-maximum suppression stages at each direction count
+  printf("\nStages by direction count, ms per call (r = 5)\n");
+  printf("%12s %8s %10s %10s %10s\n", "size", "dirs", "gradient", "ridge", "nms");
+  for (size_t c = 0; c < sizeof(sizes)/sizeof(sizes[0]); ++c)
+  {
+    int const w = sizes[c][0];
+    int const h = sizes[c][1];
+    int const r = 5;
+
+    float * const img = makeInput(w, h);
+    std::vector<float> blurred(w*h), gradX(w*h), gradY(w*h), ridge(w*h), thin(w*h);
+    blurredVarianceSSE(img, w, h, r, &blurred[0]);
+
+    int const directions[] = { 4, 8, 16 };
+    for (size_t d = 0; d < sizeof(directions)/sizeof(directions[0]); ++d)
+    {
+      setNumDirectionsSSE(directions[d]);
+
+      double const grad = timeCall([&]() { calculateGradientSSE(&blurred[0], w, h, r, &gradX[0], &gradY[0]); }, runs);
+      double const rdg  = timeCall([&]() { calculateRidgeSSE(&gradX[0], &gradY[0], w, h, r, &ridge[0]); }, runs);
+      double const nms  = timeCall([&]() { nonMaxSuppressionSSE(&ridge[0], w, h, &thin[0]); }, runs);
+
+      char size[32];
+      sprintf(size, "%dx%d", w, h);
+      printf("%12s %8d %10.3f %10.3f %10.3f\n", size, directions[d], grad, rdg, nms);
+    }
+    setNumDirectionsSSE(8);
+
+    free(img);
+  }
+
+  // the gradient and ridge stages for each specialized radius, with the generic kernels and the specialized ones
+  printf("\nStages by radius, generic / specialized kernels, ms per call (1920x1080)\n");
+  printf("%4s %10s %10s %10s %10s\n", "r", "gradient", "spec", "ridge", "spec");
+  {
+    int const w = 1920;
+    int const h = 1080;
+    int const radii[] = { 2, 3, 5, 8 };
+
+    float * const img = makeInput(w, h);
+    std::vector<float> blurred(w*h), gradX(w*h), gradY(w*h), ridge(w*h);
+
+    for (size_t c = 0; c < sizeof(radii)/sizeof(radii[0]); ++c)
+    {
+      int const r = radii[c];
+      blurredVarianceSSE(img, w, h, r, &blurred[0]);
+
+      double times[2][2];
+      for (int spec = 0; spec < 2; ++spec)
+      {
+        setRadiusSpecializationSSE(spec != 0);
+        times[spec][0] = timeCall([&]() { calculateGradientSSE(&blurred[0], w, h, r, &gradX[0], &gradY[0]); }, runs);
+        times[spec][1] = timeCall([&]() { calculateRidgeSSE(&gradX[0], &gradY[0], w, h, r, &ridge[0]); }, runs);
+      }
+      printf("%4d %10.3f %10.3f %10.3f %10.3f\n", r, times[0][0], times[1][0], times[0][1], times[1][1]);
+    }
+    setRadiusSpecializationSSE(true);
+
+    free(img);
+  }
+
+  // the whole pipeline, allocating its scratch on every call or reusing it from a context, and with the full frame
+  // gradients written out instead of the fused gradient and ridge stage
+  int const pipelineSizes[][2] = { {640, 480}, {1920, 1080}, {3840, 2160} };
+  printf("\nvrd_sse(), ms per call (r = 5)\n");
+  printf("%12s %10s %10s %10s\n", "size", "malloc", "context", "gradients");
+  for (size_t c = 0; c < sizeof(pipelineSizes)/sizeof(pipelineSizes[0]); ++c)
+  {
+    int const w = pipelineSizes[c][0];
+    int const h = pipelineSizes[c][1];
+    int const r = 5;
+
+    float * const img = makeInput(w, h);
+    std::vector<float> output(w*h), gradX(w*h), gradY(w*h);
+    VrdContext context(w, h, r);
+
+    double const plain  = timeCall([&]() { vrd_sse(img, w, h, r, &output[0]); }, runs);
+    double const reused = timeCall([&]() { vrd_sse(img, w, h, r, &output[0], &context); }, runs);
+    double const grads  = timeCall([&]() { vrd_sse(img, w, h, r, &output[0], &gradX[0], &gradY[0], &context); }, runs);
+
+    char size[32];
+    sprintf(size, "%dx%d", w, h);
+    printf("%12s %10.3f %10.3f %10.3f\n", size, plain, reused, grads);
+
+    free(img);
+  }
+
+  // three radii per frame, as separate vrd_sse() calls and from the shared integral images of vrd_sse_multi()
+  printf("\nvrd_sse_multi(), ms per call (r = 3, 5, 8)\n");
+  printf("%12s %10s %10s %10s\n", "size", "separate", "multi", "max");
+  for (size_t c = 0; c < sizeof(pipelineSizes)/sizeof(pipelineSizes[0]); ++c)
+  {
+    int const w = pipelineSizes[c][0];
+    int const h = pipelineSizes[c][1];
+    int const radii[] = { 3, 5, 8 };
+
+    float * const img = makeInput(w, h);
+    std::vector<float> scales(3*w*h), fused(w*h);
+    float * const outputs[] = { &scales[0], &scales[w*h], &scales[2*w*h] };
+    VrdContext context(w, h, 8);
+
+    double const separate = timeCall([&]()
+    {
+      for (int i = 0; i < 3; ++i)
+        vrd_sse(img, w, h, radii[i], outputs[i], &context);
+    }, runs);
+    double const multi = timeCall([&]() { vrd_sse_multi(img, w, h, radii, 3, outputs, nullptr, &context); }, runs);
+    double const max   = timeCall([&]() { vrd_sse_multi(img, w, h, radii, 3, nullptr, &fused[0], &context); }, runs);
+
+    char size[32];
+    sprintf(size, "%dx%d", w, h);
+    printf("%12s %10.3f %10.3f %10.3f\n", size, separate, multi, max);
+
+    free(img);
+  }
+
+  // edge linking on the thinned edge map, with the thresholds at the 70th and 95th percentiles of its values
+  printf("\nhysteresisSSE(), ms per call (r = 5)\n");
+  printf("%12s %10s %10s\n", "size", "map", "labels");
+  for (size_t c = 0; c < sizeof(pipelineSizes)/sizeof(pipelineSizes[0]); ++c)
+  {
+    int const w = pipelineSizes[c][0];
+    int const h = pipelineSizes[c][1];
+    int const r = 5;
+
+    float * const img = makeInput(w, h);
+    std::vector<float> ridge(w*h), thin(w*h);
+    vrd_sse(img, w, h, r, &ridge[0]);
+    nonMaxSuppressionSSE(&ridge[0], w, h, &thin[0]);
+
+    std::vector<float> sorted(thin);
+    std::sort(sorted.begin(), sorted.end());
+    float const low = sorted[sorted.size()*70/100];
+    float const high = sorted[sorted.size()*95/100];
+
+    std::vector<uint8_t> edges(w*h);
+    std::vector<int32_t> labels(w*h);
+    VrdContext context;
+    double const map    = timeCall([&]() { hysteresisSSE(&thin[0], w, h, low, high, &edges[0], nullptr, &context); }, runs);
+    double const linked = timeCall([&]() { hysteresisSSE(&thin[0], w, h, low, high, nullptr, &labels[0], &context); }, runs);
+
+    char size[32];
+    sprintf(size, "%dx%d", w, h);
+    printf("%12s %10.3f %10.3f\n", size, map, linked);
+
+    free(img);
+  }
+
+  // a burst of 32 crops as separate vrd_sse() calls, with and without a context, and as one vrd_sse_batch() call,
+  // on one thread and on one per hardware core
+  printf("\nvrd_sse_batch(), ms per 32 images (r = 5)\n");
+  printf("%12s %8s %10s %10s %10s\n", "size", "threads", "malloc", "context", "batch");
+  int const batchSizes[][2] = { {160, 120}, {640, 480} };
+  setNumThreadsSSE(0);
+  int const cores = getNumThreadsSSE();
+  for (size_t c = 0; c < sizeof(batchSizes)/sizeof(batchSizes[0]); ++c)
+  {
+    int const w = batchSizes[c][0];
+    int const h = batchSizes[c][1];
+    int const r = 5;
+    int const n = 32;
+
+    float * const img = makeInput(w, h);
+    std::vector<float> outputs(n*w*h);
+    std::vector<float const *> inputs(n, img);
+    std::vector<float *> outputPtrs(n);
+    std::vector<int> widths(n, w), heights(n, h);
+    for (int i = 0; i < n; ++i)
+      outputPtrs[i] = &outputs[i*w*h];
+
+    for (int threads = 1; ; threads = cores)
+    {
+      setNumThreadsSSE(threads);
+      VrdContext context(w, h, r);
+
+      double const plain = timeCall([&]()
+      {
+        for (int i = 0; i < n; ++i)
+          vrd_sse(img, w, h, r, outputPtrs[i]);
+      }, runs);
+      double const reused = timeCall([&]()
+      {
+        for (int i = 0; i < n; ++i)
+          vrd_sse(img, w, h, r, outputPtrs[i], &context);
+      }, runs);
+      double const batch = timeCall([&]()
+      {
+        vrd_sse_batch(&inputs[0], &widths[0], &heights[0], n, r, &outputPtrs[0], &context);
+      }, runs);
+
+      char size[32];
+      sprintf(size, "%dx%d", w, h);
+      printf("%12s %8d %10.3f %10.3f %10.3f\n", size, threads, plain, reused, batch);
+
+      if (threads == cores)
+        break;
+    }
+
+    free(img);
+  }
+  setNumThreadsSSE(1);
+
+  // a frame pushed through a VrdStream 1, 16 and 256 rows at a time, against the whole frame with the same engine
+  setBlurEngineSSE(BlurEngine::Rolling);
+  printf("\nVrdStream, ms per frame (r = 5, rolling blur)\n");
+  printf("%12s %10s %10s %10s %10s\n", "size", "vrd_sse", "1 row", "16 rows", "256 rows");
+  for (size_t c = 0; c < sizeof(pipelineSizes)/sizeof(pipelineSizes[0]); ++c)
+  {
+    int const w = pipelineSizes[c][0];
+    int const h = pipelineSizes[c][1];
+    int const r = 5;
+
+    float * const img = makeInput(w, h);
+    std::vector<float> output(w*h);
+    VrdContext context(w, h, r);
+    VrdStream stream(w, r);
+
+    double const frame = timeCall([&]() { vrd_sse(img, w, h, r, &output[0], &context); }, runs);
+    double streamed[3];
+    int const chunks[] = { 1, 16, 256 };
+    for (int i = 0; i < 3; ++i)
+      streamed[i] = timeCall([&]()
+      {
+        int rows = 0;
+        for (int y = 0; y < h; y += chunks[i])
+          rows += stream.push(img + 4*w*y, std::min(chunks[i], h-y), &output[w*rows]);
+        stream.finish(&output[w*rows]);
+      }, runs);
+
+    char size[32];
+    sprintf(size, "%dx%d", w, h);
+    printf("%12s %10.3f %10.3f %10.3f %10.3f\n", size, frame, streamed[0], streamed[1], streamed[2]);
+
+    free(img);
+  }
+  setBlurEngineSSE(BlurEngine::IntegralImage);
+
+  // a run of frames one vrd_sse() call after another, and through a VrdPipeline with the blur of each frame
+  // overlapping the gradient and ridge of the one before
+  printf("\nVrdPipeline, ms per frame (r = 5, 8 frames)\n");
+  printf("%12s %10s %10s\n", "size", "serial", "pipeline");
+  for (size_t c = 0; c < sizeof(pipelineSizes)/sizeof(pipelineSizes[0]); ++c)
+  {
+    int const w = pipelineSizes[c][0];
+    int const h = pipelineSizes[c][1];
+    int const r = 5;
+    int const frames = 8;
+
+    float * const img = makeInput(w, h);
+    std::vector<float> outputs(frames*w*h);
+    VrdContext context(w, h, r);
+    VrdPipeline pipeline(w, h, r, frames);
+
+    double const serial = timeCall([&]()
+    {
+      for (int f = 0; f < frames; ++f)
+        vrd_sse(img, w, h, r, &outputs[f*w*h], &context);
+    }, runs) / frames;
+    double const pipelined = timeCall([&]()
+    {
+      std::vector<std::future<bool>> done;
+      for (int f = 0; f < frames; ++f)
+        done.push_back(pipeline.submit(img, &outputs[f*w*h]));
+      for (int f = 0; f < frames; ++f)
+        done[f].wait();
+    }, runs) / frames;
+
+    char size[32];
+    sprintf(size, "%dx%d", w, h);
+    printf("%12s %10.3f %10.3f\n", size, serial, pipelined);
+
+    free(img);
+  }
+
+  // a static scene, and one with a 64x64 box moving across it, through a VrdVideo against whole frames
+  setBlurEngineSSE(BlurEngine::Rolling);
+  printf("\nVrdVideo, ms per frame (r = 5, rolling blur)\n");
+  printf("%12s %10s %10s %10s %10s\n", "size", "vrd_sse", "static", "moving", "rows");
+  for (size_t c = 0; c < sizeof(pipelineSizes)/sizeof(pipelineSizes[0]); ++c)
+  {
+    int const w = pipelineSizes[c][0];
+    int const h = pipelineSizes[c][1];
+    int const r = 5;
+
+    float * const img = makeInput(w, h);
+    std::vector<float> output(w*h);
+    VrdContext context(w, h, r);
+    VrdVideo video(w, h, r);
+
+    double const frame = timeCall([&]() { vrd_sse(img, w, h, r, &output[0], &context); }, runs);
+    double const still = timeCall([&]() { video.process(img, &output[0]); }, runs);
+
+    int step = 0;
+    double const moving = timeCall([&]()
+    {
+      int const x0 = (16*step) % (w - 64);
+      int const y0 = h/2 - 32;
+      for (int y = y0; y < y0 + 64; ++y)
+        for (int x = x0; x < x0 + 64; ++x)
+          img[4*(x + y*w)] = float((step + x + y) % 256);
+      ++step;
+      video.process(img, &output[0]);
+    }, runs);
+
+    char size[32];
+    sprintf(size, "%dx%d", w, h);
+    printf("%12s %10.3f %10.3f %10.3f %10.3f\n", size, frame, still, moving, video.recomputedFraction());
+
+    free(img);
+  }
+  setBlurEngineSSE(BlurEngine::IntegralImage);
+
+  // a frame whose top half is a constant sky, with and without skipping the flat tiles
+  setBlurEngineSSE(BlurEngine::Rolling);
+  printf("\nsetFlatSkipSSE(), ms per call (r = 5, rolling blur, flat top half)\n");
+  printf("%12s %10s %10s %10s\n", "size", "off", "on", "skipped");
+  for (size_t c = 0; c < sizeof(pipelineSizes)/sizeof(pipelineSizes[0]); ++c)
+  {
+    int const w = pipelineSizes[c][0];
+    int const h = pipelineSizes[c][1];
+    int const r = 5;
+
+    float * const img = makeInput(w, h);
+    std::fill(img, img + 4*w*(h/2), 100.0F);
+    std::vector<float> output(w*h);
+    VrdContext context(w, h, r);
+
+    double const off = timeCall([&]() { vrd_sse(img, w, h, r, &output[0], &context); }, runs);
+    setFlatSkipSSE(true);
+    double const on  = timeCall([&]() { vrd_sse(img, w, h, r, &output[0], &context); }, runs);
+    float const skipped = getFlatSkippedFractionSSE();
+    setFlatSkipSSE(false);
+
+    char size[32];
+    sprintf(size, "%dx%d", w, h);
+    printf("%12s %10.3f %10.3f %10.3f\n", size, off, on, skipped);
+
+    free(img);
+  }
+  setBlurEngineSSE(BlurEngine::IntegralImage);
+
+  // the tiled pipeline on 1, 2, 4, ... threads up to one per hardware core, with the speedup over one thread and
+  // the parallel efficiency (speedup / threads); near-linear scaling keeps the efficiency close to 1
+  setNumThreadsSSE(0);
+  int const maxThreads = getNumThreadsSSE();
+  printf("\nvrd_sse() by thread count, ms per call (r = 5, with a context, %d hardware threads)\n", maxThreads);
+  printf("%12s %8s %10s %10s %10s\n", "size", "threads", "vrd", "speedup", "efficiency");
+  for (size_t c = 0; c < sizeof(pipelineSizes)/sizeof(pipelineSizes[0]); ++c)
+  {
+    int const w = pipelineSizes[c][0];
+    int const h = pipelineSizes[c][1];
+    int const r = 5;
+
+    float * const img = makeInput(w, h);
+    std::vector<float> output(w*h);
+
+    double single = 0;
+    for (int threads = 1; ; threads = std::min(2*threads, maxThreads))
+    {
+      setNumThreadsSSE(threads);
+      VrdContext context(w, h, r);
+      double const t = timeCall([&]() { vrd_sse(img, w, h, r, &output[0], &context); }, runs);
+      if (threads == 1)
+        single = t;
+
+      char size[32];
+      sprintf(size, "%dx%d", w, h);
+      printf("%12s %8d %10.3f %10.2f %10.2f\n", size, threads, t, single / t, single / t / threads);
+
+      if (threads == maxThreads)
+        break;
+    }
+
+    free(img);
+  }
+  setNumThreadsSSE(1);
+
+  return 0;
+}
@@ -0,0 +1,763 @@
+/*=================================================================
+ * check.cpp - Consistency checks for the SSE Variance Ridge Detector
+ *
+ * Usage:   ./vrd_check
+ * Output:  One line per output that differs, then a summary. The exit
+ *          status is non-zero if any output differs.
+ *
+ * Every comparison is bit for bit, and is repeated at 1, 2, 3, 4 and
+ * 8 threads:
+ *  - vrd_sse(), which runs the fused gradient and ridge stage on one
+ *    thread and tiles it on several, and the overload that returns the
+ *    gradients, against calculateGradientSSE() and calculateRidgeSSE()
+ *    on one thread, for every blur engine and instruction set
+ *  - VrdStream, fed in chunks of several sizes, against vrd_sse() with
+ *    the Rolling engine on one thread
+ *  - VrdVideo, on frames that change a few boxes at a time, against the
+ *    same frames after reset()
+ *  - nonMaxSuppressionSSE() and its direction maps against one thread
+ *    with SSE, for 4, 8 and 16 directions
+ *  - VrdPipeline, fed LABX and RGB frames with Block and DropOldest
+ *    backpressure, against vrd_sse() and vrd_rgb_sse(), and dropped
+ *    frames leaving their outputs alone
+ *  - vrd_sse(), vrd_sse_batch() and VrdPipeline skipping flat tiles at
+ *    threshold 0, against no skipping, and the fraction of tiles each
+ *    of them reports as skipped
+ *
+ * The IntegralImage blur is also checked against a double precision
+ * copy of its box formulas on small integer images, to within float
+ * rounding, which pins the position of its border regions. The
+ * mirrored border blurs (Rolling, PaddedIntegral, uint8 LAB and RGB)
+ * are checked the same way against a mirrored box, including radii
+ * larger than the image. nonMaxSuppressionSSE() is also checked on
+ * ridges whose line means are worked out by hand.
+ *
+ *=================================================================*/
+#include "vrd_sse.h"
+#include "PixLABSSE.H"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+static int const threadCounts[] = { 1, 2, 3, 4, 8 };
+static int numChecks = 0;
+static int numFailures = 0;
+
+//! Count one comparison of n floats, and report it if a and b differ in any bit
+static void expectSame(float const * const a, float const * const b, int const n, char const * const what,
+    int const w, int const h, int const r)
+{
+  ++numChecks;
+  if (memcmp(a, b, sizeof(float) * n) == 0)
+    return;
+
+  int differ = 0;
+  for (int i = 0; i < n; ++i)
+    differ += memcmp(&a[i], &b[i], sizeof(float)) != 0;
+
+  ++numFailures;
+  printf("FAIL %-28s %5dx%-5d r=%-3d threads=%d: %d of %d values differ\n", what, w, h, r, getNumThreadsSSE(),
+      differ, n);
+}
+
+//! Fill an aligned w*h*4 LABX buffer with noise in the 0-255 range
+/*! The values are fractional so that sums which are only the same up to rounding show up as differences. */
+static float * makeInput(int const w, int const h)
+{
+  float * const img = static_cast<float*>(aligned_alloc(16, sizeof(float) * w * h * 4));
+  for (int i = 0; i < w*h*4; ++i)
+    img[i] = (i % 4 == 3) ? 0.0F : float(rand() % 25600) / 100.0F;
+  return img;
+}
+
+//! Fill an aligned w*h*4 LABX buffer whose top half is constant, then small noise, then full range noise
+static float * makeFlatInput(int const w, int const h)
+{
+  float * const img = static_cast<float*>(aligned_alloc(16, sizeof(float) * w * h * 4));
+  for (int y = 0; y < h; ++y)
+    for (int i = 4*y*w; i < 4*(y+1)*w; ++i)
+    {
+      int const c = i % 4;
+      if (c == 3)
+        img[i] = 0.0F;
+      else if (y < h/2)
+        img[i] = 50.0F + c;
+      else if (y < 3*h/4)
+        img[i] = 50.0F + float(rand() % 100) / 100.0F;
+      else
+        img[i] = float(rand() % 25600) / 100.0F;
+    }
+  return img;
+}
+
+//! The IntegralImage engine's blur at (x, y), in double precision from the inclusive integral images of img
+/*! Each axis picks its box the way blurRowsSSE() does: mirrored about r within r of the start, a plain 2r box in the
+    middle, and mirrored about the far end within r of it. The top right corner takes the right edge of its box from
+    column w-2-r on every row, as the engine always has. These quirks predate the tiling, and are pinned here so that
+    any change to the engine's output shows up. */
+static double integralBlurReference(std::vector<double> const & sums, std::vector<double> const & sums2, int const w,
+    int const h, int const r, int const x, int const y)
+{
+  int xlef, xrig, nx;
+  if (x < r)        { xlef = abs(x-r); xrig = x+r;           nx = x+r; }
+  else if (x < w-r) { xlef = x-r;      xrig = x+r;           nx = 2*r; }
+  else              { xlef = x-r;      xrig = 2*w-2-r-x;     nx = w+r-1-x; }
+
+  int ytop, ybot, ny;
+  if (y < r)        { ytop = abs(y-r); ybot = y+r;           ny = y+r; }
+  else if (y < h-r) { ytop = y-r;      ybot = y+r;           ny = 2*r; }
+  else              { ytop = y-r;      ybot = 2*h-2-r-y;     ny = h+r-1-y; }
+
+  if (y < r && x >= w-r)
+    xrig = w-2-r;
+
+  double const n = double(nx) * ny;
+  double l2 = 0;
+  for (int c = 0; c < 4; ++c)
+  {
+    auto box = [&](std::vector<double> const & s)
+    {
+      return s[4*(xrig + ybot*w) + c] - s[4*(xlef + ybot*w) + c] - s[4*(xrig + ytop*w) + c] + s[4*(xlef + ytop*w) + c];
+    };
+    double const mean = box(sums) / n;
+    double const var = box(sums2) / n - mean * mean;
+    l2 += var * var;
+  }
+
+  // the interior kernel returns the root of the summed squared variances, the border loops its square root
+  bool const interior = (x >= r && x < w-r && y >= r && y < h-r);
+  return interior ? sqrt(l2) : sqrt(sqrt(l2));
+}
+
+//! The IntegralImage blur, interior and borders, against integralBlurReference() on small integer images
+/*! The integer values keep the float integral images exact, so the two agree to the rounding of the final divisions
+    and roots. The output is filled with NaN first, so a pixel the blur never writes fails too. */
+static void checkIntegralBorders()
+{
+  int const cases[][3] = { {9, 8, 2}, {23, 17, 3}, {40, 30, 5}, {64, 48, 7} };
+  setBlurEngineSSE(BlurEngine::IntegralImage);
+
+  for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c)
+  {
+    int const w = cases[c][0];
+    int const h = cases[c][1];
+    int const r = cases[c][2];
+
+    float * const img = static_cast<float*>(aligned_alloc(16, sizeof(float) * w * h * 4));
+    for (int i = 0; i < w*h*4; ++i)
+      img[i] = (i % 4 == 3) ? 0.0F : float(rand() % 16);
+
+    std::vector<double> sums(w*h*4), sums2(w*h*4);
+    for (int y = 0; y < h; ++y)
+      for (int x = 0; x < w; ++x)
+        for (int k = 0; k < 4; ++k)
+        {
+          int const i = 4*(x + y*w) + k;
+          double const v = img[i];
+          sums[i]  = v     + (x ? sums[i-4]  : 0) + (y ? sums[i-4*w]  : 0) - (x && y ? sums[i-4-4*w]  : 0);
+          sums2[i] = v * v + (x ? sums2[i-4] : 0) + (y ? sums2[i-4*w] : 0) - (x && y ? sums2[i-4-4*w] : 0);
+
+          // the squared integral image starts from the unsquared first pixel, as integralImageSSE() always has
+          if (!x && !y)
+            sums2[i] = v;
+        }
+
+    std::vector<float> blurred(w*h);
+    for (int t : threadCounts)
+    {
+      setNumThreadsSSE(t);
+      std::fill(blurred.begin(), blurred.end(), NAN);
+      blurredVarianceSSE(img, w, h, r, &blurred[0]);
+
+      int differ = 0;
+      for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+        {
+          double const expected = integralBlurReference(sums, sums2, w, h, r, x, y);
+          differ += !(fabs(blurred[x + y*w] - expected) <= 1e-4 * (1.0 + expected));
+        }
+
+      ++numChecks;
+      if (differ)
+      {
+        ++numFailures;
+        printf("FAIL %-28s %5dx%-5d r=%-3d threads=%d: %d of %d values differ\n", "IntegralImage borders", w, h, r, t,
+            differ, w*h);
+      }
+    }
+    free(img);
+  }
+}
+
+//! Reflect i about the borders of [0, n) without repeating the border pixel, as often as it takes to land inside
+static int reflectIndex(int i, int const n)
+{
+  if (n == 1)
+    return 0;
+  int const period = 2*(n-1);
+  i = abs(i) % period;
+  return i < n ? i : period - i;
+}
+
+//! The mirrored border blur at (x, y) in double precision: the 2r*2r box (x-r, x+r] x (y-r, y+r] of the mirrored image
+static double mirroredBlurReference(float const * const img, int const w, int const h, int const r, int const x,
+    int const y)
+{
+  double sum[4] = { 0 }, sum2[4] = { 0 };
+  for (int j = y-r+1; j <= y+r; ++j)
+    for (int i = x-r+1; i <= x+r; ++i)
+      for (int c = 0; c < 4; ++c)
+      {
+        double const v = img[4*(reflectIndex(i, w) + reflectIndex(j, h)*w) + c];
+        sum[c] += v;
+        sum2[c] += v * v;
+      }
+
+  double const n = 4.0 * r * r;
+  double l2 = 0;
+  for (int c = 0; c < 4; ++c)
+  {
+    double const mean = sum[c] / n;
+    double const var = sum2[c] / n - mean * mean;
+    l2 += var * var;
+  }
+  return sqrt(l2);
+}
+
+//! The mirrored border blurs against mirroredBlurReference(), including radii at least the size of the image
+/*! These are the Rolling and PaddedIntegral engines, the integer blur of uint8 LAB planes and the RGB blur, which
+    converts to LAB with PixLABSSE.H. Integer LAB values keep the float sums exact, so the first three agree with the
+    reference to the rounding of the final divisions and root. The RGB blur sums fractional LAB values, and gets a
+    looser tolerance. */
+static void checkMirroredBorders()
+{
+  int const cases[][3] = { {2, 2, 1}, {2, 2, 5}, {3, 5, 4}, {5, 3, 8}, {7, 2, 3}, {16, 9, 20}, {40, 30, 5} };
+  char const * const paths[] = { "Rolling borders", "PaddedIntegral borders", "uint8 LAB borders", "RGB borders" };
+
+  for (int path = 0; path < int(sizeof(paths)/sizeof(paths[0])); ++path)
+  {
+    setBlurEngineSSE(path == 0 ? BlurEngine::Rolling : BlurEngine::PaddedIntegral);
+    for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c)
+    {
+      int const w = cases[c][0];
+      int const h = cases[c][1];
+      int const r = cases[c][2];
+
+      // the LABX image that the reference blurs, and the planar LAB or interleaved RGB bytes it comes from
+      float * const img = static_cast<float*>(aligned_alloc(16, sizeof(float) * w * h * 4));
+      std::vector<uint8_t> bytes(w*h*3);
+      for (size_t i = 0; i < bytes.size(); ++i)
+        bytes[i] = uint8_t(path == 2 ? rand() % 256 : rand() % 16);
+
+      for (int i = 0; i < w*h; ++i)
+      {
+        if (path == 3)
+        {
+          __m128 l, a, b;
+          nrt::labsse::fromRGB(_mm_set1_ps(bytes[3*i]), _mm_set1_ps(bytes[3*i+1]), _mm_set1_ps(bytes[3*i+2]), l, a, b);
+          img[4*i]   = _mm_cvtss_f32(l);
+          img[4*i+1] = _mm_cvtss_f32(a);
+          img[4*i+2] = _mm_cvtss_f32(b);
+        }
+        else
+          for (int k = 0; k < 3; ++k)
+            img[4*i+k] = bytes[i + k*w*h];
+        img[4*i+3] = 0.0F;
+      }
+      double const tolerance = (path == 3) ? 1e-3 : 1e-4;
+
+      std::vector<float> blurred(w*h);
+      for (int t : threadCounts)
+      {
+        setNumThreadsSSE(t);
+        std::fill(blurred.begin(), blurred.end(), NAN);
+        if (path == 2)
+          blurredVarianceSSE(&bytes[0], w, h, r, &blurred[0]);
+        else if (path == 3)
+          blurredVarianceRGBSSE(&bytes[0], w, h, r, &blurred[0]);
+        else
+          blurredVarianceSSE(img, w, h, r, &blurred[0]);
+
+        int differ = 0;
+        for (int y = 0; y < h; ++y)
+          for (int x = 0; x < w; ++x)
+          {
+            double const expected = mirroredBlurReference(img, w, h, r, x, y);
+            differ += !(fabs(blurred[x + y*w] - expected) <= tolerance * (1.0 + expected));
+          }
+
+        ++numChecks;
+        if (differ)
+        {
+          ++numFailures;
+          printf("FAIL %-28s %5dx%-5d r=%-3d threads=%d: %d of %d values differ\n", paths[path], w, h, r, t,
+              differ, w*h);
+        }
+      }
+      free(img);
+    }
+  }
+}
+
+//! The fused, tiled and gradient returning paths of vrd_sse() against the separate stages on one thread
+static void checkStages()
+{
+  int const cases[][3] = { {5, 4, 1}, {40, 30, 3}, {333, 211, 5}, {640, 480, 8}, {64, 300, 20} };
+  BlurEngine const engines[] = { BlurEngine::IntegralImage, BlurEngine::Rolling, BlurEngine::PaddedIntegral };
+  IsaLevel const widest = getIsaLevelSSE();
+
+  for (int level = 0; level <= int(widest); ++level)
+  {
+    setIsaLevelSSE(IsaLevel(level));
+    for (size_t e = 0; e < sizeof(engines)/sizeof(engines[0]); ++e)
+    {
+      setBlurEngineSSE(engines[e]);
+      for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c)
+      {
+        int const w = cases[c][0];
+        int const h = cases[c][1];
+        int const r = cases[c][2];
+        float * const img = makeInput(w, h);
+
+        std::vector<float> blurred(w*h), refGradX(w*h), refGradY(w*h), ref(w*h);
+        std::vector<float> edges(w*h), edgesContext(w*h), edgesGrad(w*h), gradX(w*h), gradY(w*h);
+        VrdContext context;
+        for (int t : threadCounts)
+        {
+          // the blur itself may round differently on each thread count, so the reference follows it
+          setNumThreadsSSE(t);
+          blurredVarianceSSE(img, w, h, r, &blurred[0]);
+          setNumThreadsSSE(1);
+          calculateGradientSSE(&blurred[0], w, h, r, &refGradX[0], &refGradY[0]);
+          calculateRidgeSSE(&refGradX[0], &refGradY[0], w, h, r, &ref[0]);
+
+          setNumThreadsSSE(t);
+          vrd_sse(img, w, h, r, &edges[0]);
+          vrd_sse(img, w, h, r, &edgesContext[0], &context);
+          vrd_sse(img, w, h, r, &edgesGrad[0], &gradX[0], &gradY[0]);
+
+          expectSame(&edges[0], &ref[0], w*h, "vrd_sse", w, h, r);
+          expectSame(&edgesContext[0], &ref[0], w*h, "vrd_sse with context", w, h, r);
+          expectSame(&edgesGrad[0], &ref[0], w*h, "vrd_sse with gradients", w, h, r);
+          expectSame(&gradX[0], &refGradX[0], w*h, "vrd_sse x gradient", w, h, r);
+          expectSame(&gradY[0], &refGradY[0], w*h, "vrd_sse y gradient", w, h, r);
+        }
+        free(img);
+      }
+    }
+  }
+  setIsaLevelSSE(widest);
+}
+
+//! VrdStream, fed in chunks of several sizes, against vrd_sse() with the Rolling engine on one thread
+static void checkStream()
+{
+  int const cases[][3] = { {40, 30, 3}, {64, 9, 1}, {7, 3, 5}, {3, 2, 9}, {333, 211, 5}, {640, 480, 13} };
+  int const chunks[] = { 1, 7, 32, 1000 };
+  setBlurEngineSSE(BlurEngine::Rolling);
+
+  for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c)
+  {
+    int const w = cases[c][0];
+    int const h = cases[c][1];
+    int const r = cases[c][2];
+    float * const img = makeInput(w, h);
+
+    std::vector<float> ref(w*h);
+    setNumThreadsSSE(1);
+    vrd_sse(img, w, h, r, &ref[0]);
+
+    for (int t : threadCounts)
+    {
+      setNumThreadsSSE(t);
+      VrdStream stream(w, r);
+      std::vector<float> edges(w * (h + stream.latency()));
+      for (int chunk : chunks)
+      {
+        // two frames, so that the second starts from a stream that has already finished one
+        for (int frame = 0; frame < 2; ++frame)
+        {
+          std::fill(edges.begin(), edges.end(), -1.0F);
+          int rows = 0;
+          for (int y = 0; y < h; y += chunk)
+            rows += stream.push(img + 4*w*y, std::min(chunk, h - y), &edges[w*rows]);
+          rows += stream.finish(&edges[w*rows]);
+
+          ++numChecks;
+          if (rows != h)
+          {
+            ++numFailures;
+            printf("FAIL %-28s %5dx%-5d r=%-3d threads=%d: %d rows returned\n", "VrdStream", w, h, r, t, rows);
+          }
+          else
+            expectSame(&edges[0], &ref[0], w*h, "VrdStream", w, h, r);
+        }
+      }
+    }
+    free(img);
+  }
+}
+
+//! VrdVideo on frames that change a few boxes at a time, against the same frames after reset()
+static void checkVideo()
+{
+  int const cases[][3] = { {333, 257, 2}, {640, 480, 5}, {120, 90, 13}, {9, 5, 7} };
+  int const numFrames = 10;
+
+  for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c)
+  {
+    int const w = cases[c][0];
+    int const h = cases[c][1];
+    int const r = cases[c][2];
+
+    for (int t : threadCounts)
+    {
+      setNumThreadsSSE(t);
+      float * const img = makeInput(w, h);
+      VrdVideo video(w, h, r), fresh(w, h, r);
+      std::vector<float> edges(w*h), ref(w*h);
+
+      for (int frame = 0; frame < numFrames; ++frame)
+      {
+        // one box per frame, including ones on the top and bottom borders, and one unchanged frame
+        if (frame > 0 && frame != numFrames-1)
+        {
+          int const y0 = (frame == 3) ? 0 : (frame == 4) ? h-3 : rand() % h;
+          int const x0 = rand() % w;
+          int const y1 = std::min(h, y0 + 1 + rand() % 20);
+          int const x1 = std::min(w, x0 + 1 + rand() % 30);
+          for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x)
+              for (int k = 0; k < 3; ++k)
+                img[4*(x + y*w) + k] = float(rand() % 25600) / 100.0F;
+        }
+
+        video.process(img, &edges[0]);
+        fresh.reset();
+        fresh.process(img, &ref[0]);
+        expectSame(&edges[0], &ref[0], w*h, "VrdVideo", w, h, r);
+      }
+      free(img);
+    }
+  }
+}
+
+//! vrd_sse() skipping flat tiles at threshold 0 against no skipping, for every blur engine
+static void checkFlatSkip()
+{
+  int const cases[][3] = { {64, 80, 2}, {333, 211, 5}, {640, 480, 13} };
+  BlurEngine const engines[] = { BlurEngine::IntegralImage, BlurEngine::Rolling, BlurEngine::PaddedIntegral };
+
+  for (size_t e = 0; e < sizeof(engines)/sizeof(engines[0]); ++e)
+  {
+    setBlurEngineSSE(engines[e]);
+    for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c)
+    {
+      int const w = cases[c][0];
+      int const h = cases[c][1];
+      int const r = cases[c][2];
+      float * const img = makeFlatInput(w, h);
+
+      // vrd_sse_batch() runs images this small whole on one thread each, so they match vrd_sse() on one thread
+      std::vector<float> ref(w*h), edges(w*h), single(w*h);
+      setNumThreadsSSE(1);
+      vrd_sse(img, w, h, r, &single[0]);
+
+      for (int t : threadCounts)
+      {
+        setNumThreadsSSE(t);
+        setFlatSkipSSE(false);
+        vrd_sse(img, w, h, r, &ref[0]);
+        setFlatSkipSSE(true);
+        vrd_sse(img, w, h, r, &edges[0]);
+        float const skipped = getFlatSkippedFractionSSE();
+        setFlatSkipSSE(false);
+
+        expectSame(&edges[0], &ref[0], w*h, "setFlatSkipSSE threshold 0", w, h, r);
+
+        // vrd_sse_batch() and VrdPipeline run the stages on other threads, and report each frame's fraction back
+        std::vector<float> batchEdges(3*w*h), pipeEdges(w*h);
+        float const * const batchInputs[] = { img, img, img };
+        float * const batchOutputs[] = { &batchEdges[0], &batchEdges[w*h], &batchEdges[2*w*h] };
+        int const widths[] = { w, w, w };
+        int const heights[] = { h, h, h };
+        float batchSkipped[3] = { -1.0F, -1.0F, -1.0F };
+        float pipeSkipped = -1.0F;
+        setFlatSkipSSE(true);
+        vrd_sse_batch(batchInputs, widths, heights, 3, r, batchOutputs, nullptr, batchSkipped);
+        {
+          VrdPipeline pipeline(w, h, r);
+          pipeline.submit(img, &pipeEdges[0], &pipeSkipped).get();
+        }
+        setFlatSkipSSE(false);
+
+        for (int i = 0; i < 3; ++i)
+          expectSame(batchOutputs[i], &single[0], w*h, "vrd_sse_batch flat skip", w, h, r);
+        expectSame(&pipeEdges[0], &ref[0], w*h, "VrdPipeline flat skip", w, h, r);
+
+        ++numChecks;
+        if (batchSkipped[0] != skipped || batchSkipped[1] != skipped || batchSkipped[2] != skipped ||
+            pipeSkipped != skipped)
+        {
+          ++numFailures;
+          printf("FAIL %-28s %5dx%-5d r=%-3d threads=%d: skipped %g, batch %g %g %g, pipeline %g\n",
+              "skipped fraction per frame", w, h, r, t, skipped, batchSkipped[0], batchSkipped[1], batchSkipped[2],
+              pipeSkipped);
+        }
+
+        // the Rolling engine blurs the constant half to exactly 0, so the comparison must have skipped something
+        ++numChecks;
+        if (engines[e] == BlurEngine::Rolling && skipped == 0.0F)
+        {
+          ++numFailures;
+          printf("FAIL %-28s %5dx%-5d r=%-3d threads=%d: no tile skipped\n", "setFlatSkipSSE threshold 0", w, h, r, t);
+        }
+      }
+      free(img);
+    }
+  }
+}
+
+//! nonMaxSuppressionSSE() and its direction maps against one thread with SSE, for every direction count
+static void checkNonMaxSuppression()
+{
+  int const cases[][2] = { {5, 4}, {12, 30}, {40, 30}, {333, 211}, {640, 480} };
+  int const directionCounts[] = { 4, 8, 16 };
+  IsaLevel const widest = getIsaLevelSSE();
+
+  for (int n : directionCounts)
+  {
+    setNumDirectionsSSE(n);
+    for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c)
+    {
+      int const w = cases[c][0];
+      int const h = cases[c][1];
+
+      // ridge values with some zero and negative pixels, which never survive
+      std::vector<float> ridge(w*h);
+      for (int i = 0; i < w*h; ++i)
+        ridge[i] = float(rand() % 25600 - 2560) / 100.0F * (rand() % 8 != 0);
+
+      std::vector<float> ref(w*h), refMaps(n/2*w*h), out(w*h), maps(n/2*w*h), outNoMaps(w*h);
+      setIsaLevelSSE(IsaLevel::SSE);
+      setNumThreadsSSE(1);
+      nonMaxSuppressionSSE(&ridge[0], w, h, &ref[0], &refMaps[0]);
+
+      for (int level = 0; level <= int(widest); ++level)
+      {
+        setIsaLevelSSE(IsaLevel(level));
+        for (int t : threadCounts)
+        {
+          setNumThreadsSSE(t);
+          std::fill(out.begin(), out.end(), NAN);
+          std::fill(maps.begin(), maps.end(), NAN);
+          nonMaxSuppressionSSE(&ridge[0], w, h, &out[0], &maps[0]);
+          nonMaxSuppressionSSE(&ridge[0], w, h, &outNoMaps[0]);
+
+          // there is no radius, so the direction count goes in the description
+          char what[3][40];
+          snprintf(what[0], sizeof(what[0]), "nonMaxSuppressionSSE %d dirs", n);
+          snprintf(what[1], sizeof(what[1]), "nonMaxSuppressionSSE %d no maps", n);
+          snprintf(what[2], sizeof(what[2]), "nonMaxSuppressionSSE %d maps", n);
+          expectSame(&out[0], &ref[0], w*h, what[0], w, h, 0);
+          expectSame(&outNoMaps[0], &ref[0], w*h, what[1], w, h, 0);
+          expectSame(&maps[0], &refMaps[0], n/2*w*h, what[2], w, h, 0);
+        }
+      }
+    }
+  }
+  setIsaLevelSSE(widest);
+  setNumDirectionsSSE(8);
+}
+
+//! Count one comparison of a suppressed value against its hand computed value
+static void expectNear(float const value, double const expected, char const * const what, int const x, int const y)
+{
+  ++numChecks;
+  if (fabs(value - expected) <= 1e-5 * (1.0 + fabs(expected)))
+    return;
+
+  ++numFailures;
+  printf("FAIL %-28s at (%d, %d) threads=%d: %g, expected %g\n", what, x, y, getNumThreadsSSE(), value, expected);
+}
+
+//! nonMaxSuppressionSSE() on ridges whose line means can be worked out by hand, which pins the NmsLines geometry
+/*! With 4 directions, direction 0 averages the 9 pixels from 4 above to 4 below, against the columns to either
+    side, and direction 1 the same along the row. A vertical ridge x = 10 with value y+1 at row y then survives along
+    direction 0 with strength twice the mean of the rows inside the image, and never along direction 1, whose center
+    row is always below one of its sides. The 24x11 image runs the middle rows through the vector path.
+
+    With 8 directions, direction 1 runs along x+y = const. Its center line rounds the points t*(-0.707, 0.707), t from
+    -8 to 8, to the 13 distinct offsets (-6, 6) to (6, -6), and the side lines are all off that diagonal. On the ridge
+    x+y = 14 of a 15x15 image with value x+1, (7, 7) has the mean 8, and (1, 13) keeps the 8 offsets from (-1, 1)
+    to (6, -6) inside the image, for the mean of 1 to 8. */
+static void checkNmsLines()
+{
+  IsaLevel const widest = getIsaLevelSSE();
+  for (int level = 0; level <= int(widest); ++level)
+  {
+    setIsaLevelSSE(IsaLevel(level));
+    for (int t : threadCounts)
+    {
+      setNumThreadsSSE(t);
+      {
+        int const w = 24, h = 11, ridgeX = 10;
+        std::vector<float> ridge(w*h, 0.0F), out(w*h), maps(2*w*h);
+        for (int y = 0; y < h; ++y)
+          ridge[ridgeX + y*w] = float(y+1);
+
+        setNumDirectionsSSE(4);
+        nonMaxSuppressionSSE(&ridge[0], w, h, &out[0], &maps[0]);
+        for (int y = 0; y < h; ++y)
+          for (int x = 0; x < w; ++x)
+          {
+            double strength = 0.0;
+            if (x == ridgeX)
+            {
+              int const y0 = std::max(0, y-4), y1 = std::min(h-1, y+4);
+              strength = (y0 + y1 + 2.0);   // twice the mean of y0+1 to y1+1
+            }
+            expectNear(out[x + y*w], x == ridgeX ? y+1.0 : 0.0, "NmsLines 4 output", x, y);
+            expectNear(maps[x + y*w], strength, "NmsLines 4 direction 0", x, y);
+            expectNear(maps[w*h + x + y*w], 0.0, "NmsLines 4 direction 1", x, y);
+          }
+
+        // a few of the above by hand: rows 1 to 9, rows 0 to 6, and rows 5 to 10
+        expectNear(maps[ridgeX + 5*w], 12.0, "NmsLines 4 direction 0", ridgeX, 5);
+        expectNear(maps[ridgeX + 2*w], 8.0, "NmsLines 4 direction 0", ridgeX, 2);
+        expectNear(maps[ridgeX + 9*w], 17.0, "NmsLines 4 direction 0", ridgeX, 9);
+      }
+      {
+        int const w = 15, h = 15;
+        std::vector<float> ridge(w*h, 0.0F), out(w*h), maps(4*w*h);
+        for (int x = 0; x < w; ++x)
+          ridge[x + (14-x)*w] = float(x+1);
+
+        setNumDirectionsSSE(8);
+        nonMaxSuppressionSSE(&ridge[0], w, h, &out[0], &maps[0]);
+        expectNear(out[7 + 7*w], 8.0, "NmsLines 8 output", 7, 7);
+        expectNear(maps[w*h + 7 + 7*w], 16.0, "NmsLines 8 direction 1", 7, 7);
+        expectNear(out[1 + 13*w], 2.0, "NmsLines 8 output", 1, 13);
+        expectNear(maps[w*h + 1 + 13*w], 9.0, "NmsLines 8 direction 1", 1, 13);
+        expectNear(out[8 + 7*w], 0.0, "NmsLines 8 output", 8, 7);
+        expectNear(maps[w*h + 8 + 7*w], 0.0, "NmsLines 8 direction 1", 8, 7);
+      }
+    }
+  }
+  setIsaLevelSSE(widest);
+  setNumDirectionsSSE(8);
+}
+
+//! VrdPipeline against vrd_sse() and vrd_rgb_sse(), for float and RGB frames at both Backpressure settings
+/*! Block keeps every frame. DropOldest with a queue of one drops waiting frames while the blur stage is busy, and a
+    dropped frame's future must be false with its edge map and skipped fraction untouched. Which frames drop depends
+    on timing, so only the newest frame, which nothing can replace, is sure to be kept. */
+static void checkPipeline()
+{
+  int const cases[][3] = { {333, 257, 2}, {640, 480, 5}, {61, 47, 13} };
+  BlurEngine const engines[] = { BlurEngine::IntegralImage, BlurEngine::Rolling, BlurEngine::PaddedIntegral };
+  Backpressure const backpressures[] = { Backpressure::Block, Backpressure::DropOldest };
+  int const numFrames = 6;
+  int numDropped = 0;
+
+  for (size_t e = 0; e < sizeof(engines)/sizeof(engines[0]); ++e)
+  {
+    setBlurEngineSSE(engines[e]);
+    for (size_t c = 0; c < sizeof(cases)/sizeof(cases[0]); ++c)
+    {
+      int const w = cases[c][0];
+      int const h = cases[c][1];
+      int const r = cases[c][2];
+
+      // even frames are LABX, odd frames interleaved RGB
+      std::vector<float *> frames(numFrames);
+      std::vector<std::vector<uint8_t>> rgbFrames(numFrames);
+      for (int f = 0; f < numFrames; ++f)
+      {
+        frames[f] = makeInput(w, h);
+        rgbFrames[f].resize(w*h*3);
+        for (size_t i = 0; i < rgbFrames[f].size(); ++i)
+          rgbFrames[f][i] = uint8_t(rand() % 256);
+      }
+
+      for (int t : threadCounts)
+      {
+        setNumThreadsSSE(t);
+        std::vector<std::vector<float>> ref(numFrames, std::vector<float>(w*h));
+        for (int f = 0; f < numFrames; ++f)
+          if (f % 2 == 0)
+            vrd_sse(frames[f], w, h, r, &ref[f][0]);
+          else
+            vrd_rgb_sse(&rgbFrames[f][0], w, h, r, &ref[f][0]);
+
+        for (Backpressure const backpressure : backpressures)
+        {
+          bool const drop = (backpressure == Backpressure::DropOldest);
+          std::vector<std::vector<float>> edges(numFrames, std::vector<float>(w*h, NAN));
+          std::vector<float> skipped(numFrames, -1.0F);
+          std::vector<std::future<bool>> done(numFrames);
+          {
+            VrdPipeline pipeline(w, h, r, drop ? 1 : 2, backpressure);
+            for (int f = 0; f < numFrames; ++f)
+              done[f] = (f % 2 == 0) ? pipeline.submit(frames[f], &edges[f][0], &skipped[f])
+                                     : pipeline.submitRGB(&rgbFrames[f][0], &edges[f][0], &skipped[f]);
+          }
+
+          for (int f = 0; f < numFrames; ++f)
+          {
+            char const * const what = drop ? (f % 2 ? "VrdPipeline RGB DropOldest" : "VrdPipeline DropOldest")
+                                           : (f % 2 ? "VrdPipeline RGB Block" : "VrdPipeline Block");
+            if (done[f].get())
+            {
+              expectSame(&edges[f][0], &ref[f][0], w*h, what, w, h, r);
+              continue;
+            }
+
+            // a dropped frame leaves its outputs alone, and only DropOldest may drop, never the newest frame
+            ++numDropped;
+            ++numChecks;
+            bool const untouched = skipped[f] == -1.0F &&
+              std::all_of(edges[f].begin(), edges[f].end(), [](float v) { return isnan(v); });
+            if (!drop || f == numFrames-1 || !untouched)
+            {
+              ++numFailures;
+              printf("FAIL %-28s %5dx%-5d r=%-3d threads=%d: frame %d dropped%s\n", what, w, h, r, t, f,
+                  untouched ? "" : " after writing its outputs");
+            }
+          }
+        }
+      }
+      for (float * const frame : frames)
+        free(frame);
+    }
+  }
+
+  // the blur stage is busy for far longer than it takes to submit the frames, so DropOldest must have dropped some
+  ++numChecks;
+  if (numDropped == 0)
+  {
+    ++numFailures;
+    printf("FAIL %-28s no frame was ever dropped\n", "VrdPipeline DropOldest");
+  }
+}
+
+int main()
+{
+  srand(1);
+
+  checkIntegralBorders();
+  checkMirroredBorders();
+  checkStages();
+  checkStream();
+  checkVideo();
+  checkNonMaxSuppression();
+  checkNmsLines();
+  checkPipeline();
+  checkFlatSkip();
+
+  printf("%d of %d checks failed\n", numFailures, numChecks);
+  return numFailures ? 1 : 0;
+}
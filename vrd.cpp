@@ -32,6 +32,8 @@ using namespace std;
 #define TIMER_MAG_SSE           nrt::TimeProfiler<5>::instance()
 #define TIMER_GRAD_SSE          nrt::TimeProfiler<6>::instance()
 #define TIMER_RIDGE_SSE         nrt::TimeProfiler<7>::instance()
+#define TIMER_LAB_SCALAR        nrt::TimeProfiler<8>::instance()
+#define TIMER_LAB_BATCH         nrt::TimeProfiler<9>::instance()
 
 void _print_reg(__m128 *r)
 {
@@ -63,6 +65,13 @@ namespace sse
     return Image<PixGray<float>>(output);
   }
 
+  Image<PixGray<float>> blurredVariance(Image<PixRGB<float>> const input, int const r)
+  {
+    Image<PixGray<float>, UniqueAccess> output(input.dims(), ImageInitPolicy::None);
+    blurredVarianceRGBSSE(input.pod_begin(), input.width(), input.height(), r, output.pod_begin());
+    return Image<PixGray<float>>(output);
+  }
+
   vector<Image<PixGray<float>>> calculateGradient(Image<PixGray<float>> input, int const r)
   {
     TIMER_GRAD_SSE.begin();
@@ -446,6 +455,10 @@ int main(int argc, const char** argv)
   Parameter<int> nruns(ParameterDef<int>("runs", "The number of times to run the algorithm", 1), &mgr);
   Parameter<int> r(ParameterDef<int>("radius", "The radius", 5), &mgr);
   Parameter<bool> sseonly(ParameterDef<bool>("sse_only", "If true, only run the SSE code, otherwise run the slow code too", true), &mgr);
+  Parameter<int> nthreads(ParameterDef<int>("threads", "The number of threads for the SSE code (0 for one per core)", 1), &mgr);
+  Parameter<string> blurEngine(ParameterDef<string>("blur", "The SSE blur engine, either integral or rolling", "integral"), &mgr);
+  Parameter<bool> labBench(ParameterDef<bool>("lab_bench", "If true, time the per-pixel and batch RGB to LABX conversions", false), &mgr);
+  Parameter<bool> fusedRGB(ParameterDef<bool>("fused_rgb", "If true, the SSE code converts RGB to LAB inside the blur instead of up front, with the padded integral blur whatever --blur says", false), &mgr);
   shared_ptr<ImageSink> mySink(new ImageSink("MySink"));
 
   shared_ptr<ImageSource> mySource(new ImageSource);
@@ -455,17 +468,31 @@ int main(int argc, const char** argv)
   mgr.launch();
 
   int radius = r.getVal();
+  setNumThreadsSSE(nthreads.getVal());
+  setBlurEngineSSE(blurEngine.getVal() == "rolling" ? BlurEngine::Rolling : BlurEngine::IntegralImage);
   while(mySource->ok())
   {
     Image<PixRGB<float>> input(mySource->in().convertTo<PixRGB<float>>());
     //Image<PixRGB<float>> input = readImage(imageName.getVal()).convertTo<PixRGB<float>>();
     Image<PixLAB<float>> lab(input);
-    Image<PixLABX<float>> labx(input);
 
     mySink->out(GenericImage(input), "Original RGB image");
 
     for (int i = 0; i < nruns.getVal(); i++)
     {
+      /* RGB to LABX conversion throughput */
+      if (labBench.getVal())
+      {
+        TIMER_LAB_SCALAR.begin();
+        Image<PixLABX<float>> labxScalar(input);
+        TIMER_LAB_SCALAR.end();
+
+        TIMER_LAB_BATCH.begin();
+        Image<PixLABX<float>, UniqueAccess> labxBatch(input.dims(), ImageInitPolicy::None);
+        PixLABX<float>::fromRGB(input.begin(), labxBatch.begin(), input.size());
+        TIMER_LAB_BATCH.end();
+      }
+
 #ifdef VRD_MAKE_SLOW_VERSION
       ///* Non-SSE */
       if (!sseonly.getVal())
@@ -485,7 +512,8 @@ int main(int argc, const char** argv)
       {
         NRT_INFO("Starting SSE transform");
 
-        Image<PixGray<float>>         blurred(sse::blurredVariance(labx, radius));
+        Image<PixGray<float>>         blurred(fusedRGB.getVal() ? sse::blurredVariance(input, radius) :
+                                                               sse::blurredVariance(Image<PixLABX<float>>(input), radius));
         vector<Image<PixGray<float>>> gradImgs = sse::calculateGradient(blurred, radius);
         Image<PixGray<float>>         ridgeImg(sse::calculateRidge(gradImgs, radius));
 
@@ -506,6 +534,12 @@ int main(int argc, const char** argv)
 
     NRT_INFO("Slow Var Ridge:\t" << TIMER_RIDGE_SLOW.report());
     NRT_INFO("SSE Var Ridge:\t" << TIMER_RIDGE_SSE.report());
+
+    if (labBench.getVal())
+    {
+      NRT_INFO("Scalar LABX:\t" << TIMER_LAB_SCALAR.report());
+      NRT_INFO("Batch LABX:\t" << TIMER_LAB_BATCH.report());
+    }
   }
 
   while (true);
@@ -0,0 +1,9 @@
+// The AVX2 instantiations of the VRD kernels. This file is compiled with -mavx2, and its kernels are only called
+// when the CPU supports AVX2 (see setIsaLevelSSE()).
+#include "vrd_kernels.h"
+
+VrdKernels const * vrdKernelsAVX2()
+{
+  static VrdKernels const kernels = makeKernels<SimdAVX2>();
+  return &kernels;
+}
@@ -0,0 +1,9 @@
+// The AVX-512 instantiations of the VRD kernels. This file is compiled with -mavx512f, and its kernels are only
+// called when the CPU supports AVX-512F (see setIsaLevelSSE()).
+#include "vrd_kernels.h"
+
+VrdKernels const * vrdKernelsAVX512()
+{
+  static VrdKernels const kernels = makeKernels<SimdAVX512>();
+  return &kernels;
+}
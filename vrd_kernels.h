@@ -0,0 +1,738 @@
+// The VRD kernels, written once against the vector traits in vrd_simd.h
+//
+// vrd_sse.cpp, vrd_avx2.cpp and vrd_avx512.cpp each include this file with their own compiler flags and fill a
+// VrdKernels table with the instantiations for their vector width. vrd_sse.cpp picks the widest table the CPU supports.
+#ifndef VRD_KERNELS_H
+#define VRD_KERNELS_H
+
+#include "vrd_simd.h"
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+
+//! The number of direction counts the gradient and ridge kernels are instantiated for (4, 8 and 16, see directionIndex())
+#define NUM_DIRECTION_COUNTS 3
+
+//! The index of a supported direction count in the VrdKernels gradient and ridge tables, or -1
+inline int directionIndex(int const numDirections)
+{
+  switch (numDirections)
+  {
+    case 4:  return 0;
+    case 8:  return 1;
+    case 16: return 2;
+    default: return -1;
+  }
+}
+
+//! The radii that get their own gradient and ridge kernels, with the sample offsets known at compile time
+/*! Any other radius runs the generic kernels. Each radius adds a kernel per direction count and instruction set, so
+    keep the list short. */
+#ifndef VRD_SPECIALIZED_RADII
+#define VRD_SPECIALIZED_RADII 2, 3, 5, 8
+#endif
+
+//! A list of radii, the first of which is 0 for the generic kernels
+template<int... R>
+struct RadiusList
+{
+  enum { size = sizeof...(R) };
+};
+
+typedef RadiusList<0, VRD_SPECIALIZED_RADII> KernelRadii;
+
+//! The index of the kernels for radius r in the VrdKernels gradient and ridge tables (0 for the generic ones)
+inline int radiusIndex(int const r)
+{
+  int const radii[] = { VRD_SPECIALIZED_RADII };
+  for (int i = 0; i < int(sizeof(radii)/sizeof(radii[0])); i++)
+    if (radii[i] == r)
+      return i + 1;
+  return 0;
+}
+
+//! The kernels that have a version for each instruction set
+struct VrdKernels
+{
+  //! Compute n blurred variances along a row from two rows of the integral images
+  /*! Output pixel x uses the box with corners at float offsets 4*x and 4*x+span from the top and bottom rows */
+  void (*varianceRow)(float const * const top, float const * const bot, float const * const top2, float const * const bot2,
+      int const span, float const norm, float * outputImage, int const n);
+
+  //! calculateGradientSSE() for the output rows [yBegin, yEnd), for each direction count and radius
+  /*! inputImage holds the rows from image row inputRow0 on, and must cover every row the output rows sample. gradX
+      and gradY hold the rows from image row gradRow0 on, so they can be a window of the full frame gradients */
+  void (*gradient[NUM_DIRECTION_COUNTS][KernelRadii::size])(float const * const inputImage, int const inputRow0, int const w,
+      int const h, int const r, float * gradX, float * gradY, int const gradRow0, int const yBegin, int const yEnd);
+
+  //! calculateRidgeSSE() for the output rows [yBegin, yEnd), for each direction count and radius
+  /*! gradX and gradY hold the rows from image row gradRow0 on, and must cover every row the output rows sample.
+      ridgeImage holds the rows from image row ridgeRow0 on. */
+  void (*ridge[NUM_DIRECTION_COUNTS][KernelRadii::size])(float const * const gradX, float const * const gradY, int const gradRow0,
+      int const w, int const h, int const r, float * ridgeImage, int const ridgeRow0, int const yBegin, int const yEnd);
+
+  //! nonMaxSuppressionSSE() for the output rows [yBegin, yEnd), for each direction count
+  void (*nms[NUM_DIRECTION_COUNTS])(float const * const ridgeImage, int const w, int const h, float * outputImage,
+      float * directionMaps, int const yBegin, int const yEnd);
+};
+
+//! The AVX2 kernels, defined in vrd_avx2.cpp
+VrdKernels const * vrdKernelsAVX2();
+
+//! The AVX-512 kernels, defined in vrd_avx512.cpp
+VrdKernels const * vrdKernelsAVX512();
+
+namespace
+{
+  //! The unit vectors of N evenly spaced directions, starting along +x
+  /*! Each instantiation computes its table once, on first use. */
+  template<int N>
+  struct UnitDirections
+  {
+    float dx[N];
+    float dy[N];
+
+    UnitDirections()
+    {
+      float const pi2 = 2.0f*M_PI;
+      float const norm = 1/float(N);
+
+      for (int k = 0; k < N; k++)
+      {
+        float const idx = pi2*float(k)*norm;
+        dx[k] = cos(idx);
+        dy[k] = sin(idx);
+      }
+    }
+
+    static UnitDirections const & get()
+    {
+      static UnitDirections const table;
+      return table;
+    }
+  };
+
+  //! The sum of the Taylor series of cos(x) from the term of degree n on, given that term and x^2
+  constexpr double cosSeries(double const x2, int const n, double const term)
+  {
+    return n > 60 ? 0.0 : term + cosSeries(x2, n+2, -term*x2/((n+1)*(n+2)));
+  }
+
+  //! k reduced to (-n/2, n/2], so that 2*pi*k/n is in (-pi, pi]
+  constexpr int reduceTurn(int const k, int const n)
+  {
+    return 2*(((k % n) + n) % n) > n ? ((k % n) + n) % n - n : ((k % n) + n) % n;
+  }
+
+  //! cos(2*pi*k/n) in double precision, at compile time
+  constexpr double cosTurn(int const k, int const n)
+  {
+    return cosSeries((2*M_PI*reduceTurn(k, n)/n) * (2*M_PI*reduceTurn(k, n)/n), 0, 1.0);
+  }
+
+  //! The exact cos(2*pi*k/n) of a multiple of a quarter turn (4*k % n == 0)
+  constexpr int quarterCos(int const k, int const n)
+  {
+    return ((4*k/n % 4 + 4) % 4 == 0) ? 1 : (((4*k/n % 4 + 4) % 4 == 2) ? -1 : 0);
+  }
+
+  //! The integer offset int(r*cos(2*pi*k/n)) along the x axis of direction k of n
+  constexpr int fixedOffset(int const r, int const k, int const n)
+  {
+    return (4*k % n == 0) ? r*quarterCos(k, n) : int(r*cosTurn(k, n));
+  }
+
+  //! Whether v is far enough from an integer for int(v) to match the rounding of the float r*dx[k] of Directions
+  constexpr bool clearOfInteger(double const v)
+  {
+    return (v - int(v) > 1e-4 || v - int(v) < -1e-4) && v - int(v) < 1 - 1e-4 && v - int(v) > -1 + 1e-4;
+  }
+
+  //! Whether fixedOffset(r, k, n) is sure to match the offset Directions would compute at run time
+  constexpr bool fixedOffsetExact(int const r, int const k, int const n)
+  {
+    return 4*k % n == 0 || clearOfInteger(r*cosTurn(k, n));
+  }
+
+  //! Whether the compile time x and y offsets of directions [k, n/2) all match the run time ones
+  /*! The y offset of direction k is the x offset of direction 4*k-n of 4*n, since sin(a) = cos(a - pi/2). */
+  constexpr bool fixedOffsetsExact(int const r, int const k, int const n)
+  {
+    return k >= n/2 || (fixedOffsetExact(r, k, n) && fixedOffsetExact(r, 4*k - n, 4*n) && fixedOffsetsExact(r, k+1, n));
+  }
+
+  //! The integer offsets of the first N/2 directions at radius R, known at compile time (R = 0 for none)
+  template<int N, int R>
+  struct FixedOffsets
+  {
+    static_assert(N <= 16, "FixedOffsets holds at most 8 direction pairs");
+    static_assert(R == 0 || fixedOffsetsExact(R, 0, N), "a compile time offset is too close to an integer to round like the run time one");
+
+    static constexpr int rdx[8] = { fixedOffset(R, 0, N), fixedOffset(R, 1, N), fixedOffset(R, 2, N), fixedOffset(R, 3, N),
+                                    fixedOffset(R, 4, N), fixedOffset(R, 5, N), fixedOffset(R, 6, N), fixedOffset(R, 7, N) };
+    static constexpr int rdy[8] = { fixedOffset(R, 0*4 - N, 4*N), fixedOffset(R, 1*4 - N, 4*N), fixedOffset(R, 2*4 - N, 4*N),
+                                    fixedOffset(R, 3*4 - N, 4*N), fixedOffset(R, 4*4 - N, 4*N), fixedOffset(R, 5*4 - N, 4*N),
+                                    fixedOffset(R, 6*4 - N, 4*N), fixedOffset(R, 7*4 - N, 4*N) };
+  };
+
+  template<int N, int R> constexpr int FixedOffsets<N, R>::rdx[8];
+  template<int N, int R> constexpr int FixedOffsets<N, R>::rdy[8];
+
+  //! The unit vectors of N directions and their integer offsets at radius r
+  /*! Direction k+N/2 points the opposite way to direction k, so its offsets are set to exactly the negated offsets of
+      k, and the kernels load each pair of sample points once for both directions. (Rounding r*dx[k] separately only
+      made them differ for r of 1393 and up.) The float dx and dy of the two directions are not exact negations of each
+      other, so each direction keeps its own.
+
+      With R > 0 the offsets come from FixedOffsets<N, R>, so once the kernels unroll their direction loops the
+      compiler sees them as constants. r must then equal R. */
+  template<int N, int R = 0>
+  struct Directions
+  {
+    static_assert(N % 2 == 0, "the directions must come in antipodal pairs");
+
+    float dx[N];
+    float dy[N];
+    int rdx[N];
+    int rdy[N];
+
+    Directions(int const r)
+    {
+      UnitDirections<N> const & unit = UnitDirections<N>::get();
+
+      for (int k = 0; k < N; k++)
+      {
+        dx[k] = unit.dx[k];
+        dy[k] = unit.dy[k];
+      }
+
+      for (int k = 0; k < N/2; k++)
+      {
+        rdx[k] = R ? FixedOffsets<N, R>::rdx[k] : int(r*dx[k]);
+        rdy[k] = R ? FixedOffsets<N, R>::rdy[k] : int(r*dy[k]);
+        rdx[k + N/2] = -rdx[k];
+        rdy[k + N/2] = -rdy[k];
+      }
+    }
+  };
+
+  //! Mirror a coordinate about 0 and clamp it to [0, n-2], the same way the original scalar code does
+  inline int clampCoord(int const i, int const n)
+  {
+    int const a = i < 0 ? -i : i;
+    return a < n-2 ? a : n-2;
+  }
+
+  //! Compute the squared LABX variance of V::width/4 adjacent pixels at once (see boxVariance2_ps())
+  template<class V>
+  inline typename V::vec boxVariance2(float const * const top, float const * const bot, float const * const top2,
+      float const * const bot2, int const xlef, int const span, typename V::vec const _norm)
+  {
+    typedef typename V::vec vec;
+    int const xrig = xlef + span;
+
+    vec _reslt = V::sub(V::loadu(&bot[xrig]), V::loadu(&bot[xlef]));
+    _reslt = V::sub(_reslt, V::loadu(&top[xrig]));
+    _reslt = V::add(_reslt, V::loadu(&top[xlef]));
+    _reslt = V::div(_reslt, _norm);
+
+    vec _reslt2 = V::sub(V::loadu(&bot2[xrig]), V::loadu(&bot2[xlef]));
+    _reslt2 = V::sub(_reslt2, V::loadu(&top2[xrig]));
+    _reslt2 = V::add(_reslt2, V::loadu(&top2[xlef]));
+    _reslt2 = V::div(_reslt2, _norm);
+
+    // output = integral2 - integral^2
+    vec _l2norm = V::sub(_reslt2, V::mul(_reslt, _reslt));
+    return V::mul(_l2norm, _l2norm);
+  }
+
+  //! VrdKernels::varianceRow, V::width pixels at a time
+  template<class V>
+  void varianceRow(float const * const top, float const * const bot, float const * const top2, float const * const bot2,
+      int const span, float const norm, float * outputImage, int const n)
+  {
+    typedef typename V::vec vec;
+    vec const _norm = V::set1(norm);
+
+    int x = 0;
+    for (; x + V::width <= n; x += V::width)
+    {
+      // each vector holds V::width/4 LABX pixels
+      vec _l2norm0 = boxVariance2<V>(top, bot, top2, bot2, 4*x,              span, _norm);
+      vec _l2norm1 = boxVariance2<V>(top, bot, top2, bot2, 4*x + V::width,   span, _norm);
+      vec _l2norm2 = boxVariance2<V>(top, bot, top2, bot2, 4*x + 2*V::width, span, _norm);
+      vec _l2norm3 = boxVariance2<V>(top, bot, top2, bot2, 4*x + 3*V::width, span, _norm);
+
+      V::storeu(outputImage + x, V::sqrt(V::hadd4(_l2norm0, _l2norm1, _l2norm2, _l2norm3)));
+    }
+
+    __m128 const _norm4 = _mm_set1_ps(norm);
+    for (; x < n; x++)
+    {
+      __m128 _l2norm = boxVariance2<SimdSSE>(top, bot, top2, bot2, 4*x, span, _norm4);
+
+      outputImage[x] = sqrt(hadd_ps(&_l2norm));
+    }
+  }
+
+  //! The largest horizontal offset of any direction
+  /*! Columns [reach, w-1-reach) can read i +- rdx[k] directly, without going through clampCoord(). */
+  template<int N, int R>
+  inline int horizontalReach(Directions<N, R> const & d)
+  {
+    int reach = 0;
+    for (int k = 0; k < N; k++)
+      reach = std::max(reach, std::abs(d.rdx[k]));
+    return reach;
+  }
+
+  //! The gradient of a single pixel, written to element i of its gradient rows
+  template<int N, int R>
+  inline void gradientPixel(float const * const inputImage, int const inputRow0, int const w, int const h,
+      Directions<N, R> const & d, int const i, int const j, float * gradXRow, float * gradYRow)
+  {
+    float sumX = 0.0;
+    float sumY = 0.0;
+
+    for (int k = 0; k < N; k++)
+    {
+      float val = inputImage[clampCoord(i + d.rdx[k], w) + (clampCoord(j + d.rdy[k], h) - inputRow0)*w] -
+                  inputImage[clampCoord(i - d.rdx[k], w) + (clampCoord(j - d.rdy[k], h) - inputRow0)*w];
+
+      sumX += val * d.dx[k];
+      sumY += val * d.dy[k];
+    }
+    gradXRow[i] = sumX;
+    gradYRow[i] = sumY;
+  }
+
+  //! Accumulate the gradients of V::width pixels from the differences between the + and - samples of each direction pair
+  /*! Direction k+N/2 samples the same two points as direction k the other way around, so its difference is exactly
+      -val[k]. The sums are still taken over all directions in order. */
+  template<class V, int N>
+  inline void gradientSums(typename V::vec const * const _val, typename V::vec const * const _dx, typename V::vec const * const _dy,
+      float * gradX, float * gradY)
+  {
+    typedef typename V::vec vec;
+    vec _sumX = V::zero();
+    vec _sumY = V::zero();
+
+    for (int k = 0; k < N; k++)
+    {
+      vec const _v = (k < N/2) ? _val[k] : V::neg(_val[k - N/2]);
+
+      _sumX = V::add(_sumX, V::mul(_v, _dx[k]));
+      _sumY = V::add(_sumY, V::mul(_v, _dy[k]));
+    }
+    V::storeu(gradX, _sumX);
+    V::storeu(gradY, _sumY);
+  }
+
+  //! VrdKernels::gradient, V::width pixels at a time
+  /*! Laid out like ridgeRows(): interior columns load their samples at per row linear offsets, and only the border
+      columns, at most horizontalReach() wide on each side, gather or go through gradientPixel(). R > 0 instantiates
+      the kernel for that one radius (see Directions). */
+  template<class V, int N, int R>
+  void gradientRows(float const * const inputImage, int const inputRow0, int const w, int const h, int const r, float * gradX,
+      float * gradY, int const gradRow0, int const yBegin, int const yEnd)
+  {
+    typedef typename V::vec vec;
+    typedef typename V::ivec ivec;
+    Directions<N, R> const d(R ? R : r);
+    ivec const _clamp = V::iset1(w-2);
+    int const reach = horizontalReach(d);
+    int const xBegin = std::min(reach, w);
+    int const xEnd = std::max(xBegin, w-1-reach);
+
+    vec _dx[N];
+    vec _dy[N];
+    for (int k = 0; k < N; k++)
+    {
+      _dx[k] = V::set1(d.dx[k]);
+      _dy[k] = V::set1(d.dy[k]);
+    }
+
+    for (int j = yBegin; j < yEnd; j++)
+    {
+      float const * rowp[N/2];
+      float const * rowm[N/2];
+      for (int k = 0; k < N/2; k++)
+      {
+        rowp[k] = inputImage + (clampCoord(j + d.rdy[k], h) - inputRow0)*w;
+        rowm[k] = inputImage + (clampCoord(j - d.rdy[k], h) - inputRow0)*w;
+      }
+      float * const gradXRow = gradX + (j - gradRow0)*w;
+      float * const gradYRow = gradY + (j - gradRow0)*w;
+
+      int i = 0;
+      for (; i < xBegin; i++)
+        gradientPixel(inputImage, inputRow0, w, h, d, i, j, gradXRow, gradYRow);
+
+      for (; i + V::width <= xEnd; i += V::width)
+      {
+        vec _val[N/2];
+        for (int k = 0; k < N/2; k++)
+          _val[k] = V::sub(V::loadu(rowp[k] + d.rdx[k] + i), V::loadu(rowm[k] - d.rdx[k] + i));
+
+        gradientSums<V, N>(_val, _dx, _dy, gradXRow + i, gradYRow + i);
+      }
+
+      for (; i + V::width <= w; i += V::width)
+      {
+        ivec const _i = V::iadd(V::iset1(i), V::iramp());
+
+        vec _val[N/2];
+        for (int k = 0; k < N/2; k++)
+        {
+          ivec const _rdx = V::iset1(d.rdx[k]);
+
+          _val[k] = V::sub(V::gather(rowp[k], V::imin(V::iabs(V::iadd(_i, _rdx)), _clamp)),
+                           V::gather(rowm[k], V::imin(V::iabs(V::isub(_i, _rdx)), _clamp)));
+        }
+
+        gradientSums<V, N>(_val, _dx, _dy, gradXRow + i, gradYRow + i);
+      }
+
+      for (; i < w; i++)
+        gradientPixel(inputImage, inputRow0, w, h, d, i, j, gradXRow, gradYRow);
+    }
+  }
+
+  //! The ridge of a single pixel
+  template<int N, int R>
+  inline void ridgePixel(float const * const gradX, float const * const gradY, int const gradRow0, int const w, int const h,
+      Directions<N, R> const & d, int const i, int const j, float * ridgeImage, int const ridgeRow0)
+  {
+    float max = -INFINITY;
+
+    for (int k = 0; k < N; k++)
+    {
+      int const p = clampCoord(i + d.rdx[k], w) + (clampCoord(j + d.rdy[k], h) - gradRow0)*w;
+      int const m = clampCoord(i - d.rdx[k], w) + (clampCoord(j - d.rdy[k], h) - gradRow0)*w;
+
+      float rgeo = sqrt(fmax(0.0F, -(gradX[m] * d.dx[k] + gradY[m] * d.dy[k]) * (gradX[p] * d.dx[k] + gradY[p] * d.dy[k])));
+      float rarith = fmax(0.0F, (gradX[m] * d.dx[k] + gradY[m] * d.dy[k]) - (gradX[p] * d.dx[k] + gradY[p] * d.dy[k]));
+
+      max = fmax(max, rgeo+rarith);
+    }
+    int const c = i + (j - gradRow0)*w;
+    ridgeImage[i+(j-ridgeRow0)*w] = fabs((max - sqrt(pow(gradX[c], 2) + pow(gradY[c], 2)))-128);
+  }
+
+  //! The ridge response along one direction, given the gradients at the - and + samples
+  template<class V>
+  inline typename V::vec ridgeDirection(typename V::vec const _gxm, typename V::vec const _gym, typename V::vec const _gxp,
+      typename V::vec const _gyp, typename V::vec const _dx, typename V::vec const _dy)
+  {
+    typedef typename V::vec vec;
+
+    vec _projm = V::add(V::mul(_gxm, _dx), V::mul(_gym, _dy));
+    vec _projp = V::add(V::mul(_gxp, _dx), V::mul(_gyp, _dy));
+
+    vec _rgeo   = V::sqrt(V::max(V::zero(), V::mul(V::neg(_projm), _projp)));
+    vec _rarith = V::max(V::zero(), V::sub(_projm, _projp));
+
+    return V::add(_rgeo, _rarith);
+  }
+
+  //! The largest ridge response over all directions of V::width pixels, from the gradients at each pair's sample points
+  /*! Direction k+N/2 swaps the - and + samples of direction k. The maximum is still taken over all directions in
+      order. */
+  template<class V, int N>
+  inline typename V::vec ridgeMax(typename V::vec const * const _gxm, typename V::vec const * const _gym,
+      typename V::vec const * const _gxp, typename V::vec const * const _gyp, typename V::vec const * const _dx,
+      typename V::vec const * const _dy)
+  {
+    typedef typename V::vec vec;
+    vec _max = V::set1(-INFINITY);
+
+    for (int k = 0; k < N/2; k++)
+      _max = V::max(_max, ridgeDirection<V>(_gxm[k], _gym[k], _gxp[k], _gyp[k], _dx[k], _dy[k]));
+
+    for (int k = 0; k < N/2; k++)
+    {
+      int const o = k + N/2;
+      _max = V::max(_max, ridgeDirection<V>(_gxp[k], _gyp[k], _gxm[k], _gym[k], _dx[o], _dy[o]));
+    }
+    return _max;
+  }
+
+  //! VrdKernels::ridge, V::width pixels at a time
+  /*! Each row gets a table of linear offsets from pixel i to its - and + samples in every direction. Interior
+      columns load the samples of V::width pixels with plain unaligned loads at those offsets. Any full vectors left
+      over at the right border gather mirrored samples, and the rest of the border is done one pixel at a time. */
+  template<class V, int N, int R>
+  void ridgeRows(float const * const gradX, float const * const gradY, int const gradRow0, int const w, int const h, int const r,
+      float * ridgeImage, int const ridgeRow0, int const yBegin, int const yEnd)
+  {
+    typedef typename V::vec vec;
+    typedef typename V::ivec ivec;
+    Directions<N, R> const d(R ? R : r);
+    ivec const _clamp = V::iset1(w-2);
+    int const reach = horizontalReach(d);
+    int const xBegin = std::min(reach, w);
+    int const xEnd = std::max(xBegin, w-1-reach);
+
+    vec _dx[N];
+    vec _dy[N];
+    for (int k = 0; k < N; k++)
+    {
+      _dx[k] = V::set1(d.dx[k]);
+      _dy[k] = V::set1(d.dy[k]);
+    }
+
+    for (int j = yBegin; j < yEnd; j++)
+    {
+      int rowp[N/2];
+      int rowm[N/2];
+      int offp[N/2];
+      int offm[N/2];
+      for (int k = 0; k < N/2; k++)
+      {
+        rowp[k] = (clampCoord(j + d.rdy[k], h) - gradRow0)*w;
+        rowm[k] = (clampCoord(j - d.rdy[k], h) - gradRow0)*w;
+        offp[k] = rowp[k] + d.rdx[k];
+        offm[k] = rowm[k] - d.rdx[k];
+      }
+      int const c = (j - gradRow0)*w;
+
+      int i = 0;
+      for (; i < xBegin; i++)
+        ridgePixel(gradX, gradY, gradRow0, w, h, d, i, j, ridgeImage, ridgeRow0);
+
+      for (; i + V::width <= xEnd; i += V::width)
+      {
+        vec _gxm[N/2], _gym[N/2], _gxp[N/2], _gyp[N/2];
+        for (int k = 0; k < N/2; k++)
+        {
+          _gxm[k] = V::loadu(gradX + offm[k] + i);
+          _gym[k] = V::loadu(gradY + offm[k] + i);
+          _gxp[k] = V::loadu(gradX + offp[k] + i);
+          _gyp[k] = V::loadu(gradY + offp[k] + i);
+        }
+        vec const _max = ridgeMax<V, N>(_gxm, _gym, _gxp, _gyp, _dx, _dy);
+
+        V::storeu(ridgeImage + i + (j - ridgeRow0)*w, V::ridgeOutput(_max, V::loadu(gradX + i + c), V::loadu(gradY + i + c)));
+      }
+
+      for (; i + V::width <= w; i += V::width)
+      {
+        ivec const _i = V::iadd(V::iset1(i), V::iramp());
+
+        vec _gxm[N/2], _gym[N/2], _gxp[N/2], _gyp[N/2];
+        for (int k = 0; k < N/2; k++)
+        {
+          ivec const _rdx = V::iset1(d.rdx[k]);
+          ivec const _ip = V::imin(V::iabs(V::iadd(_i, _rdx)), _clamp);
+          ivec const _im = V::imin(V::iabs(V::isub(_i, _rdx)), _clamp);
+
+          _gxm[k] = V::gather(gradX + rowm[k], _im);
+          _gym[k] = V::gather(gradY + rowm[k], _im);
+          _gxp[k] = V::gather(gradX + rowp[k], _ip);
+          _gyp[k] = V::gather(gradY + rowp[k], _ip);
+        }
+        vec const _max = ridgeMax<V, N>(_gxm, _gym, _gxp, _gyp, _dx, _dy);
+
+        V::storeu(ridgeImage + i + (j - ridgeRow0)*w, V::ridgeOutput(_max, V::loadu(gradX + i + c), V::loadu(gradY + i + c)));
+      }
+
+      for (; i < w; i++)
+        ridgePixel(gradX, gradY, gradRow0, w, h, d, i, j, ridgeImage, ridgeRow0);
+    }
+  }
+
+  //! The pixel offsets that non-maximum suppression averages for each of the N/2 ridge directions
+  /*! Ridge direction k compares the gradients on either side of a pixel along direction k, so the ridge itself runs
+      along the perpendicular. The center line samples 2N+1 points along the ridge, rounded to pixels with duplicates
+      dropped, and the left and right lines are the same points moved one pixel across the ridge to either side. Each
+      instantiation computes its table once, on first use. */
+  template<int N>
+  struct NmsLines
+  {
+    enum { maxPoints = 2*N+1 };
+
+    int count[N/2][3];             //!< The number of points on the center, left and right lines
+    float invCount[N/2][3];        //!< 1/count, so that the means are products
+    int dx[N/2][3][maxPoints];
+    int dy[N/2][3][maxPoints];
+    int reach;                     //!< The largest |dx| or |dy|, so pixels at least this far inside have every point
+
+    NmsLines() : reach(0)
+    {
+      UnitDirections<N> const & u = UnitDirections<N>::get();
+      int const side[3] = { 0, 1, -1 };
+
+      for (int k = 0; k < N/2; k++)
+        for (int s = 0; s < 3; s++)
+        {
+          int & n = count[k][s];
+          n = 0;
+          for (int t = -N; t <= N; t++)
+          {
+            int const x = int(lround(-double(u.dy[k])*t + double(u.dx[k])*side[s]));
+            int const y = int(lround( double(u.dx[k])*t + double(u.dy[k])*side[s]));
+
+            bool seen = false;
+            for (int p = 0; p < n; p++)
+              seen = seen || (dx[k][s][p] == x && dy[k][s][p] == y);
+            if (seen)
+              continue;
+
+            dx[k][s][n] = x;
+            dy[k][s][n] = y;
+            n++;
+            reach = std::max(reach, std::max(abs(x), abs(y)));
+          }
+          invCount[k][s] = 1.0f / float(n);
+        }
+    }
+
+    static NmsLines const & get()
+    {
+      static NmsLines const table;
+      return table;
+    }
+  };
+
+  //! The non-maximum suppression of a single pixel, averaging only the points that fall inside the image
+  /*! A pixel survives if it is positive and, along some ridge direction, the mean of its center line is above the
+      means of both side lines. directionMaps, if not null, gets the strength 2*center - right - left of each
+      direction the pixel survives along, and 0 for the others. */
+  template<int N>
+  inline void nmsPixel(float const * const ridgeImage, int const w, int const h, NmsLines<N> const & lines, int const i,
+      int const j, float * outputImage, float * directionMaps)
+  {
+    float const val = ridgeImage[i + j*w];
+    bool any = false;
+
+    for (int k = 0; k < N/2; k++)
+    {
+      float mean[3];
+      bool empty = false;
+      for (int s = 0; s < 3; s++)
+      {
+        float total = 0.0f;
+        int n = 0;
+        for (int p = 0; p < lines.count[k][s]; p++)
+        {
+          int const x = i + lines.dx[k][s][p];
+          int const y = j + lines.dy[k][s][p];
+          if (x >= 0 && x < w && y >= 0 && y < h)
+          {
+            total += ridgeImage[x + y*w];
+            n++;
+          }
+        }
+        empty = empty || n == 0;
+        mean[s] = total * (1.0f / float(n));
+      }
+
+      // a side with no points inside the image cannot be compared against
+      bool const isMax = !empty && mean[0] > mean[1] && mean[0] > mean[2] && val > 0.0f;
+      any = any || isMax;
+      if (directionMaps)
+        directionMaps[k*w*h + i + j*w] = isMax ? mean[0]*2.0f - mean[2] - mean[1] : 0.0f;
+    }
+
+    outputImage[i + j*w] = any ? val : 0.0f;
+  }
+
+  //! VrdKernels::nms, V::width pixels at a time
+  /*! Pixels at least NmsLines::reach from every border read their lines at precomputed linear offsets, with no bounds
+      checks. The means are the same products as in nmsPixel(), so the vector and scalar paths agree bit for bit. */
+  template<class V, int N>
+  void nmsRows(float const * const ridgeImage, int const w, int const h, float * outputImage, float * directionMaps,
+      int const yBegin, int const yEnd)
+  {
+    typedef typename V::vec vec;
+    typedef typename V::mask mask;
+
+    NmsLines<N> const & lines = NmsLines<N>::get();
+    int const reach = lines.reach;
+
+    int offset[N/2][3][NmsLines<N>::maxPoints];
+    vec _inv[N/2][3];
+    for (int k = 0; k < N/2; k++)
+      for (int s = 0; s < 3; s++)
+      {
+        for (int p = 0; p < lines.count[k][s]; p++)
+          offset[k][s][p] = lines.dx[k][s][p] + lines.dy[k][s][p]*w;
+        _inv[k][s] = V::set1(lines.invCount[k][s]);
+      }
+
+    vec const _two = V::set1(2.0f);
+    vec const _zero = V::zero();
+
+    for (int j = yBegin; j < yEnd; j++)
+    {
+      int i = 0;
+      if (j >= reach && j < h - reach)
+      {
+        for (; i < std::min(reach, w); i++)
+          nmsPixel(ridgeImage, w, h, lines, i, j, outputImage, directionMaps);
+
+        for (; i + V::width <= w - reach; i += V::width)
+        {
+          float const * const center = ridgeImage + i + j*w;
+          vec const _val = V::loadu(center);
+          mask const _positive = V::gt(_val, _zero);
+          mask _any = V::mnone();
+
+          for (int k = 0; k < N/2; k++)
+          {
+            vec _mean[3];
+            for (int s = 0; s < 3; s++)
+            {
+              vec _total = V::zero();
+              for (int p = 0; p < lines.count[k][s]; p++)
+                _total = V::add(_total, V::loadu(center + offset[k][s][p]));
+              _mean[s] = V::mul(_total, _inv[k][s]);
+            }
+
+            mask const _max = V::mand(V::mand(V::gt(_mean[0], _mean[1]), V::gt(_mean[0], _mean[2])), _positive);
+            _any = V::mor(_any, _max);
+            if (directionMaps)
+              V::storeu(directionMaps + k*w*h + i + j*w,
+                  V::maskz(_max, V::sub(V::sub(V::mul(_mean[0], _two), _mean[2]), _mean[1])));
+          }
+
+          V::storeu(outputImage + i + j*w, V::maskz(_any, _val));
+        }
+      }
+
+      for (; i < w; i++)
+        nmsPixel(ridgeImage, w, h, lines, i, j, outputImage, directionMaps);
+    }
+  }
+
+  //! Fill the gradient and ridge kernels of direction count N for each radius in the list, starting at table slot
+  template<class V, int N>
+  inline void fillRadiusKernels(VrdKernels &, int const, RadiusList<>)
+  {
+  }
+
+  template<class V, int N, int R, int... Rest>
+  inline void fillRadiusKernels(VrdKernels & kernels, int const slot, RadiusList<R, Rest...>)
+  {
+    kernels.gradient[directionIndex(N)][slot] = &gradientRows<V, N, R>;
+    kernels.ridge[directionIndex(N)][slot] = &ridgeRows<V, N, R>;
+    fillRadiusKernels<V, N>(kernels, slot+1, RadiusList<Rest...>());
+  }
+
+  //! The kernel table for the vector traits V
+  template<class V>
+  VrdKernels makeKernels()
+  {
+    VrdKernels kernels;
+    kernels.varianceRow = &varianceRow<V>;
+    fillRadiusKernels<V, 4>(kernels, 0, KernelRadii());
+    fillRadiusKernels<V, 8>(kernels, 0, KernelRadii());
+    fillRadiusKernels<V, 16>(kernels, 0, KernelRadii());
+    kernels.nms[directionIndex(4)] = &nmsRows<V, 4>;
+    kernels.nms[directionIndex(8)] = &nmsRows<V, 8>;
+    kernels.nms[directionIndex(16)] = &nmsRows<V, 16>;
+    return kernels;
+  }
+}
+
+#endif // VRD_KERNELS_H
@@ -0,0 +1,304 @@
+// Vector traits used to write the VRD kernels once for every instruction set
+//
+// Each translation unit that includes this file only gets the traits its compiler flags allow (SimdAVX2 needs -mavx2,
+// SimdAVX512 needs -mavx512f). Everything lives in an unnamed namespace so that the copies compiled with different
+// flags are never merged by the linker, which could otherwise hand AVX-512 code to a machine without it.
+#ifndef VRD_SIMD_H
+#define VRD_SIMD_H
+
+// GCC 12 and older fill the unused lanes of unmasked AVX-512 intrinsics from a self-initialised register, which
+// makes -Wall report every one of them as maybe-uninitialized (GCC bug 105593)
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#else
+#include <immintrin.h>
+#endif
+
+namespace
+{
+  //! Horizontally add the 4 elements of an SSE register
+  inline float hadd_ps(__m128 *a)
+  {
+    float data[4];
+    _mm_store_ps(data, *a);
+
+    return data[0] + data[1] + data[2] + data[3];
+  }
+
+  //! Horizontally add four LABX vectors at once, returning (hadd_ps(a), hadd_ps(b), hadd_ps(c), hadd_ps(d))
+  /*! The vectors are transposed in registers so that each one holds a single channel of all four pixels, and the
+      channels are then summed in the same order as hadd_ps(). */
+  inline __m128 hadd4_ps(__m128 a, __m128 b, __m128 c, __m128 d)
+  {
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+
+    return _mm_add_ps(_mm_add_ps(_mm_add_ps(a, b), c), d);
+  }
+
+  //! Compute the squared LABX variance of one box from the corners of the integral and squared integral images
+  inline __m128 boxVariance2_ps(float const * const integral, float const * const integral2,
+      int const xlef, int const xrig, int const ytop, int const ybot, __m128 const _norm)
+  {
+    __m128 _toplef = _mm_load_ps( &integral[ xlef + ytop ] );
+    __m128 _toprig = _mm_load_ps( &integral[ xrig + ytop ] );
+    __m128 _botrig = _mm_load_ps( &integral[ xrig + ybot ] );
+    __m128 _botlef = _mm_load_ps( &integral[ xlef + ybot ] );
+
+    __m128 _reslt = _mm_sub_ps(_botrig, _botlef);
+    _reslt = _mm_sub_ps(_reslt, _toprig);
+    _reslt = _mm_add_ps(_reslt, _toplef);
+    _reslt = _mm_div_ps(_reslt, _norm);
+
+    __m128 _toplef2 = _mm_load_ps( &integral2[ xlef + ytop ] );
+    __m128 _toprig2 = _mm_load_ps( &integral2[ xrig + ytop ] );
+    __m128 _botrig2 = _mm_load_ps( &integral2[ xrig + ybot ] );
+    __m128 _botlef2 = _mm_load_ps( &integral2[ xlef + ybot ] );
+
+    __m128 _reslt2 = _mm_sub_ps(_botrig2, _botlef2);
+    _reslt2 = _mm_sub_ps(_reslt2, _toprig2);
+    _reslt2 = _mm_add_ps(_reslt2, _toplef2);
+    _reslt2 = _mm_div_ps(_reslt2, _norm);
+
+    // output = integral2 - integral^2
+    __m128 _l2norm = _mm_sub_ps(_reslt2, _mm_mul_ps(_reslt, _reslt));
+    return _mm_mul_ps(_l2norm, _l2norm);
+  }
+
+  //! 128 bit SSE2 vectors of 4 floats
+  struct SimdSSE
+  {
+    typedef __m128  vec;
+    typedef __m128i ivec;
+    enum { width = 4 };
+
+    static inline vec zero()                     { return _mm_setzero_ps(); }
+    static inline vec set1(float const a)        { return _mm_set1_ps(a); }
+    static inline vec loadu(float const * p)     { return _mm_loadu_ps(p); }
+    static inline void storeu(float * p, vec a)  { _mm_storeu_ps(p, a); }
+    static inline vec add(vec a, vec b)          { return _mm_add_ps(a, b); }
+    static inline vec sub(vec a, vec b)          { return _mm_sub_ps(a, b); }
+    static inline vec mul(vec a, vec b)          { return _mm_mul_ps(a, b); }
+    static inline vec div(vec a, vec b)          { return _mm_div_ps(a, b); }
+    static inline vec max(vec a, vec b)          { return _mm_max_ps(a, b); }
+    static inline vec sqrt(vec a)                { return _mm_sqrt_ps(a); }
+    static inline vec neg(vec a)                 { return _mm_xor_ps(a, _mm_set1_ps(-0.f)); }
+
+    typedef __m128 mask;
+    static inline mask mnone()                   { return _mm_setzero_ps(); }
+    static inline mask gt(vec a, vec b)          { return _mm_cmpgt_ps(a, b); }
+    static inline mask mand(mask a, mask b)      { return _mm_and_ps(a, b); }
+    static inline mask mor(mask a, mask b)       { return _mm_or_ps(a, b); }
+    //! a where m is set and 0 elsewhere
+    static inline vec maskz(mask m, vec a)       { return _mm_and_ps(m, a); }
+
+    static inline ivec iset1(int const a)        { return _mm_set1_epi32(a); }
+    static inline ivec iramp()                   { return _mm_set_epi32(3, 2, 1, 0); }
+    static inline ivec iadd(ivec a, ivec b)      { return _mm_add_epi32(a, b); }
+    static inline ivec isub(ivec a, ivec b)      { return _mm_sub_epi32(a, b); }
+    static inline ivec iabs(ivec a)
+    {
+      ivec const s = _mm_srai_epi32(a, 31);
+      return _mm_sub_epi32(_mm_xor_si128(a, s), s);
+    }
+    static inline ivec imin(ivec a, ivec b)
+    {
+      ivec const gt = _mm_cmpgt_epi32(a, b);
+      return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+    }
+
+    //! Load base[idx[i]] into element i
+    static inline vec gather(float const * base, ivec idx)
+    {
+      int i[4];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(i), idx);
+      return _mm_set_ps(base[i[3]], base[i[2]], base[i[1]], base[i[0]]);
+    }
+
+    //! Sum the LABX channels of the pixels held in a, b, c, d (one pixel each), returning the 4 sums in pixel order
+    static inline vec hadd4(vec a, vec b, vec c, vec d) { return hadd4_ps(a, b, c, d); }
+
+    //! fabs((ridge - sqrt(gx^2 + gy^2)) - 128), evaluated in double precision like the scalar code
+    static inline vec ridgeOutput(vec ridge, vec gx, vec gy)
+    {
+      __m128d const signmask = _mm_set1_pd(-0.0);
+      __m128d const c128 = _mm_set1_pd(128.0);
+
+      __m128d gxlo = _mm_cvtps_pd(gx), gxhi = _mm_cvtps_pd(_mm_movehl_ps(gx, gx));
+      __m128d gylo = _mm_cvtps_pd(gy), gyhi = _mm_cvtps_pd(_mm_movehl_ps(gy, gy));
+      __m128d rlo  = _mm_cvtps_pd(ridge), rhi = _mm_cvtps_pd(_mm_movehl_ps(ridge, ridge));
+
+      __m128d maglo = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(gxlo, gxlo), _mm_mul_pd(gylo, gylo)));
+      __m128d maghi = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(gxhi, gxhi), _mm_mul_pd(gyhi, gyhi)));
+
+      __m128d lo = _mm_andnot_pd(signmask, _mm_sub_pd(_mm_sub_pd(rlo, maglo), c128));
+      __m128d hi = _mm_andnot_pd(signmask, _mm_sub_pd(_mm_sub_pd(rhi, maghi), c128));
+
+      return _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+    }
+  };
+
+#ifdef __AVX2__
+  //! 256 bit AVX2 vectors of 8 floats
+  struct SimdAVX2
+  {
+    typedef __m256  vec;
+    typedef __m256i ivec;
+    enum { width = 8 };
+
+    static inline vec zero()                     { return _mm256_setzero_ps(); }
+    static inline vec set1(float const a)        { return _mm256_set1_ps(a); }
+    static inline vec loadu(float const * p)     { return _mm256_loadu_ps(p); }
+    static inline void storeu(float * p, vec a)  { _mm256_storeu_ps(p, a); }
+    static inline vec add(vec a, vec b)          { return _mm256_add_ps(a, b); }
+    static inline vec sub(vec a, vec b)          { return _mm256_sub_ps(a, b); }
+    static inline vec mul(vec a, vec b)          { return _mm256_mul_ps(a, b); }
+    static inline vec div(vec a, vec b)          { return _mm256_div_ps(a, b); }
+    static inline vec max(vec a, vec b)          { return _mm256_max_ps(a, b); }
+    static inline vec sqrt(vec a)                { return _mm256_sqrt_ps(a); }
+    static inline vec neg(vec a)                 { return _mm256_xor_ps(a, _mm256_set1_ps(-0.f)); }
+
+    typedef __m256 mask;
+    static inline mask mnone()                   { return _mm256_setzero_ps(); }
+    static inline mask gt(vec a, vec b)          { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static inline mask mand(mask a, mask b)      { return _mm256_and_ps(a, b); }
+    static inline mask mor(mask a, mask b)       { return _mm256_or_ps(a, b); }
+    //! a where m is set and 0 elsewhere
+    static inline vec maskz(mask m, vec a)       { return _mm256_and_ps(m, a); }
+
+    static inline ivec iset1(int const a)        { return _mm256_set1_epi32(a); }
+    static inline ivec iramp()                   { return _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0); }
+    static inline ivec iadd(ivec a, ivec b)      { return _mm256_add_epi32(a, b); }
+    static inline ivec isub(ivec a, ivec b)      { return _mm256_sub_epi32(a, b); }
+    static inline ivec iabs(ivec a)              { return _mm256_abs_epi32(a); }
+    static inline ivec imin(ivec a, ivec b)      { return _mm256_min_epi32(a, b); }
+
+    static inline vec gather(float const * base, ivec idx) { return _mm256_i32gather_ps(base, idx, 4); }
+
+    //! Sum the LABX channels of the pixels held in a, b, c, d (two pixels each), returning the 8 sums in pixel order
+    /*! The 4x4 transpose runs within each 128 bit lane, which leaves pixels 0,2,4,6 in the low lane and 1,3,5,7 in
+        the high lane, so the sums are permuted back into order at the end. */
+    static inline vec hadd4(vec a, vec b, vec c, vec d)
+    {
+      vec const t0 = _mm256_unpacklo_ps(a, b);
+      vec const t1 = _mm256_unpackhi_ps(a, b);
+      vec const t2 = _mm256_unpacklo_ps(c, d);
+      vec const t3 = _mm256_unpackhi_ps(c, d);
+
+      vec const c0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+      vec const c1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+      vec const c2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+      vec const c3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+
+      vec const sum = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(c0, c1), c2), c3);
+      return _mm256_permutevar8x32_ps(sum, _mm256_set_epi32(7, 3, 6, 2, 5, 1, 4, 0));
+    }
+
+    //! fabs((ridge - sqrt(gx^2 + gy^2)) - 128), evaluated in double precision like the scalar code
+    static inline vec ridgeOutput(vec ridge, vec gx, vec gy)
+    {
+      __m256d const signmask = _mm256_set1_pd(-0.0);
+      __m256d const c128 = _mm256_set1_pd(128.0);
+
+      __m256d gxlo = _mm256_cvtps_pd(_mm256_castps256_ps128(gx)), gxhi = _mm256_cvtps_pd(_mm256_extractf128_ps(gx, 1));
+      __m256d gylo = _mm256_cvtps_pd(_mm256_castps256_ps128(gy)), gyhi = _mm256_cvtps_pd(_mm256_extractf128_ps(gy, 1));
+      __m256d rlo  = _mm256_cvtps_pd(_mm256_castps256_ps128(ridge)), rhi = _mm256_cvtps_pd(_mm256_extractf128_ps(ridge, 1));
+
+      __m256d maglo = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(gxlo, gxlo), _mm256_mul_pd(gylo, gylo)));
+      __m256d maghi = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(gxhi, gxhi), _mm256_mul_pd(gyhi, gyhi)));
+
+      __m256d lo = _mm256_andnot_pd(signmask, _mm256_sub_pd(_mm256_sub_pd(rlo, maglo), c128));
+      __m256d hi = _mm256_andnot_pd(signmask, _mm256_sub_pd(_mm256_sub_pd(rhi, maghi), c128));
+
+      return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(lo)), _mm256_cvtpd_ps(hi), 1);
+    }
+  };
+#endif // __AVX2__
+
+#ifdef __AVX512F__
+  //! 512 bit AVX-512 vectors of 16 floats
+  struct SimdAVX512
+  {
+    typedef __m512  vec;
+    typedef __m512i ivec;
+    enum { width = 16 };
+
+    static inline vec zero()                     { return _mm512_setzero_ps(); }
+    static inline vec set1(float const a)        { return _mm512_set1_ps(a); }
+    static inline vec loadu(float const * p)     { return _mm512_loadu_ps(p); }
+    static inline void storeu(float * p, vec a)  { _mm512_storeu_ps(p, a); }
+    static inline vec add(vec a, vec b)          { return _mm512_add_ps(a, b); }
+    static inline vec sub(vec a, vec b)          { return _mm512_sub_ps(a, b); }
+    static inline vec mul(vec a, vec b)          { return _mm512_mul_ps(a, b); }
+    static inline vec div(vec a, vec b)          { return _mm512_div_ps(a, b); }
+    static inline vec max(vec a, vec b)          { return _mm512_max_ps(a, b); }
+    static inline vec sqrt(vec a)                { return _mm512_sqrt_ps(a); }
+    static inline vec neg(vec a)
+    { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x80000000))); }
+
+    typedef __mmask16 mask;
+    static inline mask mnone()                   { return 0; }
+    static inline mask gt(vec a, vec b)          { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    static inline mask mand(mask a, mask b)      { return a & b; }
+    static inline mask mor(mask a, mask b)       { return a | b; }
+    //! a where m is set and 0 elsewhere
+    static inline vec maskz(mask m, vec a)       { return _mm512_maskz_mov_ps(m, a); }
+
+    static inline ivec iset1(int const a)        { return _mm512_set1_epi32(a); }
+    static inline ivec iramp()                   { return _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0); }
+    static inline ivec iadd(ivec a, ivec b)      { return _mm512_add_epi32(a, b); }
+    static inline ivec isub(ivec a, ivec b)      { return _mm512_sub_epi32(a, b); }
+    static inline ivec iabs(ivec a)              { return _mm512_abs_epi32(a); }
+    static inline ivec imin(ivec a, ivec b)      { return _mm512_min_epi32(a, b); }
+
+    static inline vec gather(float const * base, ivec idx) { return _mm512_i32gather_ps(idx, base, 4); }
+
+    //! Sum the LABX channels of the pixels held in a, b, c, d (four pixels each), returning the 16 sums in pixel order
+    /*! The 4x4 transpose runs within each 128 bit lane, which leaves pixels l, 4+l, 8+l, 12+l in lane l, so the sums
+        are permuted back into order at the end. */
+    static inline vec hadd4(vec a, vec b, vec c, vec d)
+    {
+      vec const t0 = _mm512_unpacklo_ps(a, b);
+      vec const t1 = _mm512_unpackhi_ps(a, b);
+      vec const t2 = _mm512_unpacklo_ps(c, d);
+      vec const t3 = _mm512_unpackhi_ps(c, d);
+
+      vec const c0 = _mm512_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+      vec const c1 = _mm512_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+      vec const c2 = _mm512_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+      vec const c3 = _mm512_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+
+      vec const sum = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(c0, c1), c2), c3);
+      return _mm512_permutexvar_ps(_mm512_set_epi32(15, 11, 7, 3, 14, 10, 6, 2, 13, 9, 5, 1, 12, 8, 4, 0), sum);
+    }
+
+    //! fabs((ridge - sqrt(gx^2 + gy^2)) - 128), evaluated in double precision like the scalar code
+    static inline vec ridgeOutput(vec ridge, vec gx, vec gy)
+    {
+      __m512d const c128 = _mm512_set1_pd(128.0);
+
+      __m512d gxlo = _mm512_cvtps_pd(_mm512_castps512_ps256(gx)), gxhi = _mm512_cvtps_pd(upper(gx));
+      __m512d gylo = _mm512_cvtps_pd(_mm512_castps512_ps256(gy)), gyhi = _mm512_cvtps_pd(upper(gy));
+      __m512d rlo  = _mm512_cvtps_pd(_mm512_castps512_ps256(ridge)), rhi = _mm512_cvtps_pd(upper(ridge));
+
+      __m512d maglo = _mm512_sqrt_pd(_mm512_add_pd(_mm512_mul_pd(gxlo, gxlo), _mm512_mul_pd(gylo, gylo)));
+      __m512d maghi = _mm512_sqrt_pd(_mm512_add_pd(_mm512_mul_pd(gxhi, gxhi), _mm512_mul_pd(gyhi, gyhi)));
+
+      __m512d lo = _mm512_abs_pd(_mm512_sub_pd(_mm512_sub_pd(rlo, maglo), c128));
+      __m512d hi = _mm512_abs_pd(_mm512_sub_pd(_mm512_sub_pd(rhi, maghi), c128));
+
+      __m512d out = _mm512_insertf64x4(_mm512_setzero_pd(), _mm256_castps_pd(_mm512_cvtpd_ps(lo)), 0);
+      return _mm512_castpd_ps(_mm512_insertf64x4(out, _mm256_castps_pd(_mm512_cvtpd_ps(hi)), 1));
+    }
+
+    //! The upper 8 floats of a vector
+    static inline __m256 upper(vec a)
+    { return _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a), 1)); }
+  };
+#endif // __AVX512F__
+}
+
+#endif // VRD_SIMD_H
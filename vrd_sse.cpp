@@ -1,56 +1,634 @@
 #include "vrd_sse.h"
+#include "vrd_kernels.h"
+#include "PixLABSSE.H"
 #include <emmintrin.h> // sse3
 #include <xmmintrin.h> // sse
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! The kernels written against the SSE vector traits (the 128 bit integral image code is below)
+static VrdKernels const vrdKernelsSSE = makeKernels<SimdSSE>();
+
+//! Find the widest instruction set supported by both the CPU and the OS, lowered by the VRD_ISA environment variable
+static IsaLevel detectIsaLevel()
+{
+  // this runs from a static initializer, possibly before libgcc has filled in the CPU model
+  __builtin_cpu_init();
+
+  IsaLevel level = IsaLevel::SSE;
+  if (__builtin_cpu_supports("avx2"))    level = IsaLevel::AVX2;
+  if (__builtin_cpu_supports("avx512f")) level = IsaLevel::AVX512;
+
+  char const * const env = getenv("VRD_ISA");
+  if (env)
+  {
+    IsaLevel requested = level;
+    if      (strcmp(env, "sse") == 0)    requested = IsaLevel::SSE;
+    else if (strcmp(env, "avx2") == 0)   requested = IsaLevel::AVX2;
+    else if (strcmp(env, "avx512") == 0) requested = IsaLevel::AVX512;
+    else fprintf(stderr, "vrd_sse: ignoring unknown VRD_ISA=%s (expected sse, avx2 or avx512)\n", env);
+
+    if (requested > level)
+      fprintf(stderr, "vrd_sse: VRD_ISA=%s is not supported by this CPU, using the widest supported level\n", env);
+    else
+      level = requested;
+  }
+  return level;
+}
 
-#define NUM_GRADIENT_DIRECTIONS 8
-#define NUM_RIDGE_DIRECTIONS    NUM_GRADIENT_DIRECTIONS/2
-#define BOUNDARY_STEP_SIZE      NUM_GRADIENT_DIRECTIONS
+static IsaLevel const vrdMaxIsaLevel = detectIsaLevel();
+static IsaLevel vrdIsaLevel = vrdMaxIsaLevel;
 
-inline float hadd_ps(__m128 *a)
-{ 
-  float data[4];
-  _mm_store_ps(data, *a);
+//! The kernels for the selected instruction set
+static VrdKernels const * vrdKernels()
+{
+  switch (vrdIsaLevel)
+  {
+    case IsaLevel::AVX512: return vrdKernelsAVX512();
+    case IsaLevel::AVX2:   return vrdKernelsAVX2();
+    default:               return &vrdKernelsSSE;
+  }
+}
 
-  return data[0] + data[1] + data[2] + data[3];
+static int vrdNumThreads = 1;
+static thread_local bool vrdSerialWorker = false; //!< Set on the threads that vrd_sse_batch() gives whole images to
+static BlurEngine vrdBlurEngine = BlurEngine::IntegralImage;
+static int vrdNumDirections = 8;
+static bool vrdSpecializeRadii = true;
+static bool vrdFlatSkip = false;
+static float vrdFlatThreshold = 0.0f;
+static thread_local float vrdFlatSkipped = 0.0f; //!< The fraction of tiles the last edge map on this thread skipped
+
+//! The number of threads the stages may use when called from this thread
+/*! This is setNumThreadsSSE(), except on the vrd_sse_batch() workers, which already run one whole image per thread. */
+static inline int stageThreads()
+{
+  return vrdSerialWorker ? 1 : vrdNumThreads;
 }
 
-void vrd_sse(float const * const inputImage, int const w, int const h, int const r, float * outputImage)
+//! Run func(band, bandBegin, bandEnd) over numBands equal row bands of [begin, end), one thread per band
+template<class Func>
+static void parallelBandsIndexed(int const numBands, int const begin, int const end, Func func)
 {
-  float * const vGradient = (float * const)malloc(sizeof(float) * w * h);
-  float * const hGradient = (float * const)malloc(sizeof(float) * w * h);
+  std::vector<std::thread> threads;
+  int const n = end - begin;
+  for (int b = 1; b < numBands; b++)
+    threads.push_back(std::thread(func, b, begin + (n*b)/numBands, begin + (n*(b+1))/numBands));
 
-  blurredVarianceSSE(inputImage, w, h, r, outputImage);
-  calculateGradientSSE(outputImage, w, h, r, vGradient, hGradient);
-  calculateRidgeSSE(vGradient, hGradient, w, h, r, outputImage);
+  func(0, begin, begin + n/numBands);
 
-  free(vGradient);
-  free(hGradient);
+  for (size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
 }
 
-void vrd_sse(float const * const inputImage, int const w, int const h, int const r, float * outputImage, float * vGradient, float * hGradient)
+//! Run func(bandBegin, bandEnd) over numBands equal row bands of [begin, end), one thread per band
+template<class Func>
+static void parallelBands(int const numBands, int const begin, int const end, Func func)
 {
-  blurredVarianceSSE(inputImage, w, h, r, outputImage);
-  calculateGradientSSE(outputImage, w, h, r, vGradient, hGradient);
-  calculateRidgeSSE(vGradient, hGradient, w, h, r, outputImage);
+  parallelBandsIndexed(numBands, begin, end, [&](int, int y0, int y1) { func(y0, y1); });
 }
 
-void blurredVarianceSSE(float const * const inputImage, int const w, int const h, int const r, float * outputImage)
+//! Run func(worker, tileBegin, tileEnd) over the tiles of tileRows rows that make up [begin, end), on numThreads threads
+/*! Rather than splitting the rows evenly up front as parallelBands() does, each thread takes the next tile from a
+    shared counter whenever it finishes one. The border tiles, which go through the slower clamped paths, then do not
+    hold up the threads that drew them. worker is in [0, numThreads) and selects func's per thread scratch. */
+template<class Func>
+static void parallelTiles(int const numThreads, int const begin, int const end, int const tileRows, Func func)
 {
-  float * const integral  = (float * const)malloc(sizeof(float) * w * h * 4);
-  float * const integral2 = (float * const)malloc(sizeof(float) * w * h * 4);
+  int const numTiles = (end - begin + tileRows - 1) / tileRows;
+  std::atomic<int> next(0);
 
-  // pre-compute some constants used below
-  int const norm_2r = 2*r;
-  int const norm_2r2 = 2*r*r;
-  int const norm_r2 = r*r;
-  int const norm_w1r = w+r-1;
-  int const norm_h1r = h+r-1;
+  auto worker = [&](int const t)
+  {
+    for (int tile = next++; tile < numTiles; tile = next++)
+      func(t, begin + tile*tileRows, std::min(end, begin + (tile+1)*tileRows));
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < std::min(numThreads, numTiles); t++)
+    threads.push_back(std::thread(worker, t));
+
+  worker(0);
+
+  for (size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+}
+
+//! The number of rows per tile when numThreads threads share h rows with parallelTiles()
+/*! About eight tiles per thread leaves enough of them to even out the load, with at least minRows rows per tile. */
+static inline int tileRowsFor(int const h, int const numThreads, int const minRows)
+{
+  return std::max(minRows, h / (8*numThreads));
+}
+
+//! Run func(runBegin, runEnd) over each run of set rows in rows
+template<class Func>
+static void forEachRun(std::vector<uint8_t> const & rows, Func func)
+{
+  int const h = int(rows.size());
+  for (int y = 0; y < h; )
+  {
+    if (!rows[y])
+    {
+      y++;
+      continue;
+    }
+    int end = y + 1;
+    while (end < h && rows[end])
+      end++;
+    func(y, end);
+    y = end;
+  }
+}
+
+//! The scratch buffers of a VrdContext
+enum VrdBuffer
+{
+  IntegralBuffer,  //!< The integral image (float or uint32)
+  Integral2Buffer, //!< The squared integral image (float or uint32)
+  CarryBuffer,     //!< One row of integral image per band for integralCarrySSE()
+  Carry2Buffer,    //!< One row of squared integral image per band for integralCarrySSE()
+  BandBuffer,      //!< bandScratchSize() bytes of per band row scratch
+  GradXBuffer,     //!< One window of horizontal gradient rows per thread for gradientRidgeFusedSSE(), or a full frame
+  GradYBuffer,     //!< One window of vertical gradient rows per thread for gradientRidgeFusedSSE(), or a full frame
+  BlurBuffer,      //!< The blurred image, when the gradient and ridge tiles run in parallel or a VrdVideo caches it
+  UnionFindBuffer, //!< The union-find parents and strong root flags of hysteresisSSE()
+  ScaleBuffer,     //!< The edge map of one radius, when vrd_sse_multi() only returns the maximum over radii
+  InputBuffer,     //!< The window of input rows of a VrdStream, or the previous frame of a VrdVideo
+  EdgeBuffer       //!< The edge map a VrdVideo keeps between frames
+};
+
+//! Round a buffer size up to a whole number of 64 byte cache lines
+static inline size_t cacheLines(size_t const size)
+{
+  return (size + 63) & ~size_t(63);
+}
+
+//! The per band row scratch needed by any of the blur engines
+/*! The padded builds need one LABX row buffer and a column offset table, the rolling engine two rows of column sums. */
+static inline size_t bandScratchSize(int const w, int const r)
+{
+  return cacheLines(std::max(sizeof(float)*4*w + sizeof(int)*(w+2*r), sizeof(float)*8*w));
+}
+
+//! The number of output rows gradientRidgeFusedSSE() computes per step
+/*! Its gradient window, the band plus an r row halo above and below, is sized to fit both gradients in 256 KB so they
+    stay in L2 between the gradient and the ridge. */
+static inline int fusedBandRows(int const w, int const r)
+{
+  int const windowRows = (256*1024) / int(2*sizeof(float)*w);
+  return std::max(8, windowRows - 2*r);
+}
+
+//! The number of gradient rows gradientRidgeFusedSSE() keeps for a w*h image
+static inline int fusedWindowRows(int const w, int const h, int const r)
+{
+  return std::min(h, fusedBandRows(w, r) + 2*r);
+}
+
+//! The per band row scratch of band b, out of numBands
+static inline char * bandScratch(VrdContext & context, int const w, int const r, int const numBands, int const b)
+{
+  size_t const size = bandScratchSize(w, r);
+  return static_cast<char *>(context.buffer(BandBuffer, size * numBands)) + size * b;
+}
+
+VrdContext::VrdContext(int const maxW, int const maxH, int const maxR)
+{
+  for (int i = 0; i < numBuffers; i++)
+  {
+    buffers[i] = NULL;
+    sizes[i] = 0;
+  }
+
+  flatSkipped = 0.0f;
+
+  if (maxW > 0 && maxH > 0)
+    reserve(maxW, maxH, maxR);
+}
+
+VrdContext::~VrdContext()
+{
+  for (int i = 0; i < numBuffers; i++)
+    free(buffers[i]);
+}
+
+void VrdContext::reserve(int const w, int const h, int const r)
+{
+  // the padded integral images are the largest of the engines
+  int const numBands = std::max(1, stageThreads());
+  size_t const integralSize = sizeof(float) * 4 * (w+2*r) * (h+2*r);
+  size_t const carrySize = sizeof(float) * 4 * (w+2*r) * numBands;
+
+  buffer(IntegralBuffer, integralSize);
+  buffer(Integral2Buffer, integralSize);
+  buffer(CarryBuffer, carrySize);
+  buffer(Carry2Buffer, carrySize);
+  buffer(BandBuffer, bandScratchSize(w, r) * numBands);
+  buffer(GradXBuffer, sizeof(float) * w * fusedWindowRows(w, h, r) * numBands);
+  buffer(GradYBuffer, sizeof(float) * w * fusedWindowRows(w, h, r) * numBands);
+  if (numBands > 1 || vrdFlatSkip)
+    buffer(BlurBuffer, sizeof(float) * w * h);
+}
+
+void * VrdContext::buffer(int const index, size_t const size)
+{
+  if (size > sizes[index])
+  {
+    // the old contents are not needed, so there is no point in copying them
+    free(buffers[index]);
+    size_t const newSize = cacheLines(size);
+    if (posix_memalign(&buffers[index], 64, newSize) != 0)
+    {
+      fprintf(stderr, "vrd_sse: failed to allocate %lu bytes of scratch memory\n", (unsigned long)newSize);
+      abort();
+    }
+    sizes[index] = newSize;
+  }
+  return buffers[index];
+}
+
+size_t VrdContext::size() const
+{
+  size_t total = 0;
+  for (int i = 0; i < numBuffers; i++)
+    total += sizes[i];
+  return total;
+}
+
+void setNumThreadsSSE(int const numThreads)
+{
+  if (numThreads > 0)
+    vrdNumThreads = numThreads;
+  else
+    vrdNumThreads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+int getNumThreadsSSE()
+{
+  return vrdNumThreads;
+}
+
+void setBlurEngineSSE(BlurEngine const engine)
+{
+  vrdBlurEngine = engine;
+}
+
+BlurEngine getBlurEngineSSE()
+{
+  return vrdBlurEngine;
+}
+
+void setIsaLevelSSE(IsaLevel const level)
+{
+  vrdIsaLevel = std::min(level, vrdMaxIsaLevel);
+}
+
+IsaLevel getIsaLevelSSE()
+{
+  return vrdIsaLevel;
+}
+
+void setNumDirectionsSSE(int const numDirections)
+{
+  if (directionIndex(numDirections) < 0)
+    fprintf(stderr, "vrd_sse: ignoring unsupported direction count %d (expected 4, 8 or 16)\n", numDirections);
+  else
+    vrdNumDirections = numDirections;
+}
+
+int getNumDirectionsSSE()
+{
+  return vrdNumDirections;
+}
+
+void setRadiusSpecializationSSE(bool const enabled)
+{
+  vrdSpecializeRadii = enabled;
+}
+
+bool getRadiusSpecializationSSE()
+{
+  return vrdSpecializeRadii;
+}
+
+void setFlatSkipSSE(bool const enabled, float const threshold)
+{
+  vrdFlatSkip = enabled;
+  vrdFlatThreshold = std::max(0.0f, threshold);
+}
+
+bool getFlatSkipSSE()
+{
+  return vrdFlatSkip;
+}
+
+float getFlatSkippedFractionSSE()
+{
+  return vrdFlatSkipped;
+}
+
+float VrdContext::flatSkippedFraction() const
+{
+  return flatSkipped;
+}
+
+void VrdContext::setFlatSkippedFraction(float const fraction)
+{
+  flatSkipped = fraction;
+}
+
+//! Record the fraction of flat tiles an edge map skipped, in its context and for the calling thread
+static void recordFlatSkipped(VrdContext & ctx, float const fraction)
+{
+  ctx.setFlatSkippedFraction(fraction);
+  vrdFlatSkipped = fraction;
+}
+
+//! Reflect a coordinate about the borders of [0, n) without repeating the border pixel
+/*! Coordinates more than n-1 outside, as with a radius of at least the image size, are reflected back and forth
+    until they land inside. A single pixel reflects onto itself. */
+static inline int reflect101(int i, int const n)
+{
+  if (n == 1)
+    return 0;
+  while (i < 0 || i >= n)
+    i = i < 0 ? -i : 2*(n-1) - i;
+  return i;
+}
+
+//! Run the gradient and ridge stages on the output rows [yBegin, yEnd), one band of rows at a time
+/*! Only a window of gradient rows, the band plus an r row halo above and below, is kept in gradX and gradY (each
+    fusedWindowRows() rows), so the gradients go from the gradient kernel to the ridge kernel through L2 instead of
+    through two full frame buffers. Moving to the next band keeps the window rows the two bands share and computes
+    only the new ones, so within [yBegin, yEnd) every gradient row is computed once.
+
+    blurred and ridgeImage may be the same image when a single call covers all rows: the ridge of band [y0, y1)
+    overwrites rows that the gradients of later bands no longer read, since those only sample rows from y1 on. The
+    output is the same as running the two stages in turn. */
+static void gradientRidgeFusedSSE(float const * const blurred, float * const ridgeImage, int const w, int const h, int const r,
+    int const yBegin, int const yEnd, float * const gradX, float * const gradY)
+{
+  VrdKernels const * const kernels = vrdKernels();
+  int const d = directionIndex(vrdNumDirections);
+  int const ri = vrdSpecializeRadii ? radiusIndex(r) : 0;
+  int const band = fusedBandRows(w, r);
+
+  // the window holds the gradient rows [lo, hi)
+  int lo = 0;
+  int hi = 0;
+  for (int y0 = yBegin; y0 < yEnd; y0 += band)
+  {
+    int const y1 = std::min(yEnd, y0 + band);
+    int const newLo = std::max(0, y0 - r);
+    int const newHi = std::min(h, y1 + r);
+
+    if (newLo < hi)
+    {
+      memmove(gradX, gradX + (newLo - lo)*w, sizeof(float) * w * (hi - newLo));
+      memmove(gradY, gradY + (newLo - lo)*w, sizeof(float) * w * (hi - newLo));
+    }
+    else
+      hi = newLo;
+    lo = newLo;
+
+    kernels->gradient[d][ri](blurred, 0, w, h, r, gradX, gradY, lo, hi, newHi);
+    hi = newHi;
+
+    kernels->ridge[d][ri](gradX, gradY, lo, w, h, r, ridgeImage, 0, y0, y1);
+  }
+}
+
+//! Run the fused gradient and ridge stages on the output rows [yBegin, yEnd), from a blurred image into a separate edge map
+/*! On several threads the output rows are cut into parallelTiles() tiles, and each one recomputes the r gradient rows
+    of halo it shares with its neighbours. The gradient windows are taken from the context. */
+static void gradientRidgeRowsSSE(float const * const blurred, float * const outputImage, int const w, int const h, int const r,
+    int const yBegin, int const yEnd, VrdContext & ctx)
+{
+  int const numThreads = std::min(stageThreads(), yEnd - yBegin);
+  int const windowFloats = w * fusedWindowRows(w, h, r);
+  float * const gradX = static_cast<float *>(ctx.buffer(GradXBuffer, sizeof(float) * windowFloats * numThreads));
+  float * const gradY = static_cast<float *>(ctx.buffer(GradYBuffer, sizeof(float) * windowFloats * numThreads));
+
+  if (numThreads == 1)
+  {
+    gradientRidgeFusedSSE(blurred, outputImage, w, h, r, yBegin, yEnd, gradX, gradY);
+    return;
+  }
+
+  parallelTiles(numThreads, yBegin, yEnd, tileRowsFor(yEnd - yBegin, numThreads, std::max(8, 4*r)), [=](int t, int y0, int y1)
+  {
+    gradientRidgeFusedSSE(blurred, outputImage, w, h, r, y0, y1, gradX + t*windowFloats, gradY + t*windowFloats);
+  });
+}
+
+//! The number of rows per tile of the setFlatSkipSSE() activity mask
+static int const flatTileRows = 16;
+
+//! The edge map value of a pixel whose gradients, and those of its ridge samples, are all zero
+static float const flatRidge = 128.0f;
+
+//! Find the smallest and largest value of each of the rows [yBegin, yEnd) of image
+static void rowRangesSSE(float const * const image, int const w, int const yBegin, int const yEnd, float * const rowMin,
+    float * const rowMax)
+{
+  for (int y = yBegin; y < yEnd; y++)
+  {
+    float const * const row = image + y*w;
+    __m128 _min = _mm_set1_ps(INFINITY);
+    __m128 _max = _mm_set1_ps(-INFINITY);
+
+    int i = 0;
+    for (; i + 4 <= w; i += 4)
+    {
+      __m128 const _val = _mm_loadu_ps(row + i);
+      _min = _mm_min_ps(_min, _val);
+      _max = _mm_max_ps(_max, _val);
+    }
+
+    float mins[4];
+    float maxs[4];
+    _mm_storeu_ps(mins, _min);
+    _mm_storeu_ps(maxs, _max);
+    float lo = std::min(std::min(mins[0], mins[1]), std::min(mins[2], mins[3]));
+    float hi = std::max(std::max(maxs[0], maxs[1]), std::max(maxs[2], maxs[3]));
+    for (; i < w; i++)
+    {
+      lo = std::min(lo, row[i]);
+      hi = std::max(hi, row[i]);
+    }
+    rowMin[y] = lo;
+    rowMax[y] = hi;
+  }
+}
+
+//! Run the gradient and ridge stages from a blurred image into a separate edge map, skipping flat tiles if enabled
+/*! With setFlatSkipSSE() on, the output rows are cut into tiles of flatTileRows rows. The edge map of a tile only
+    depends on the blurred rows up to 2r rows above and below it (r through the ridge samples and r more through the
+    gradient samples, with the borders mirrored or clamped back into that range). When the blurred values in those
+    rows span no more than the threshold, the tile is filled with flatRidge instead. For a span of 0 every gradient
+    difference is exactly 0, and so is the ridge response, which makes flatRidge the exact result. */
+static void gradientRidgeSSE(float const * const blurred, float * const outputImage, int const w, int const h, int const r,
+    VrdContext & ctx)
+{
+  if (!vrdFlatSkip)
+  {
+    recordFlatSkipped(ctx, 0.0f);
+    gradientRidgeRowsSSE(blurred, outputImage, w, h, r, 0, h, ctx);
+    return;
+  }
+
+  std::vector<float> rowMin(h), rowMax(h);
+  parallelTiles(std::min(stageThreads(), h), 0, h, tileRowsFor(h, stageThreads(), 8), [&](int, int y0, int y1)
+  {
+    rowRangesSSE(blurred, w, y0, y1, &rowMin[0], &rowMax[0]);
+  });
+
+  int const numTiles = (h + flatTileRows - 1) / flatTileRows;
+  int numFlat = 0;
+  std::vector<uint8_t> activeRows(h, 1);
+  for (int t = 0; t < numTiles; t++)
+  {
+    int const y0 = t*flatTileRows;
+    int const y1 = std::min(h, y0 + flatTileRows);
+    float const lo = *std::min_element(&rowMin[0] + std::max(0, y0 - 2*r), &rowMin[0] + std::min(h, y1 + 2*r));
+    float const hi = *std::max_element(&rowMax[0] + std::max(0, y0 - 2*r), &rowMax[0] + std::min(h, y1 + 2*r));
+    if (hi - lo <= vrdFlatThreshold)
+    {
+      std::fill(activeRows.begin() + y0, activeRows.begin() + y1, 0);
+      std::fill(outputImage + y0*w, outputImage + y1*w, flatRidge);
+      numFlat++;
+    }
+  }
+  recordFlatSkipped(ctx, float(numFlat) / numTiles);
+
+  forEachRun(activeRows, [&](int const y0, int const y1)
+  {
+    gradientRidgeRowsSSE(blurred, outputImage, w, h, r, y0, y1, ctx);
+  });
+}
+
+//! Run the gradient and ridge stages after blur(context, blurredImage)
+/*! The gradients are only written out as full frames when the caller asks for them. Otherwise the two stages run
+    fused (see gradientRidgeFusedSSE()): in place on one thread, or from the blurred image in the context on several
+    threads or when flat tiles are skipped (see gradientRidgeSSE()). */
+template<class Blur>
+static void vrdStagesSSE(Blur blur, int const w, int const h, int const r, float * outputImage, float * vGradient, float * hGradient,
+    VrdContext * context)
+{
+  VrdContext localContext;
+  VrdContext & ctx = context ? *context : localContext;
+  int const numThreads = std::min(stageThreads(), h);
+
+  if (vGradient && hGradient)
+  {
+    recordFlatSkipped(ctx, 0.0f);
+    blur(ctx, outputImage);
+    calculateGradientSSE(outputImage, w, h, r, vGradient, hGradient);
+    calculateRidgeSSE(vGradient, hGradient, w, h, r, outputImage);
+    return;
+  }
+
+  // the flat tiles are filled while the blurred image is still needed, so they need the separate blurred image
+  if (numThreads == 1 && !vrdFlatSkip)
+  {
+    recordFlatSkipped(ctx, 0.0f);
+    blur(ctx, outputImage);
+
+    // the blur is done with its scratch, so the gradient window can be taken from the context afterwards
+    size_t const windowSize = sizeof(float) * w * fusedWindowRows(w, h, r);
+    float * const gradX = static_cast<float *>(ctx.buffer(GradXBuffer, windowSize));
+    float * const gradY = static_cast<float *>(ctx.buffer(GradYBuffer, windowSize));
+    gradientRidgeFusedSSE(outputImage, outputImage, w, h, r, 0, h, gradX, gradY);
+    return;
+  }
+
+  float * const blurred = static_cast<float *>(ctx.buffer(BlurBuffer, sizeof(float) * w * h));
+  blur(ctx, blurred);
+  gradientRidgeSSE(blurred, outputImage, w, h, r, ctx);
+}
+
+void vrd_sse(float const * const inputImage, int const w, int const h, int const r, float * outputImage, VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceSSE(inputImage, w, h, r, blurred, &ctx); },
+      w, h, r, outputImage, NULL, NULL, context);
+}
+
+void vrd_sse(float const * const inputImage, int const w, int const h, int const r, float * outputImage, float * vGradient, float * hGradient,
+    VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceSSE(inputImage, w, h, r, blurred, &ctx); },
+      w, h, r, outputImage, vGradient, hGradient, context);
+}
+
+void vrd_sse(uint8_t const * const inputImage, int const w, int const h, int const r, float * outputImage, VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceSSE(inputImage, w, h, r, blurred, &ctx); },
+      w, h, r, outputImage, NULL, NULL, context);
+}
+
+void vrd_sse(uint8_t const * const inputImage, int const w, int const h, int const r, float * outputImage, float * vGradient, float * hGradient,
+    VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceSSE(inputImage, w, h, r, blurred, &ctx); },
+      w, h, r, outputImage, vGradient, hGradient, context);
+}
+
+void vrd_sse(float const * const inputImage, int const w, int const h, size_t const pitch, int const r, float * outputImage,
+    VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceSSE(inputImage, w, h, pitch, r, blurred, &ctx); },
+      w, h, r, outputImage, NULL, NULL, context);
+}
+
+void vrd_sse(float const * const l, float const * const a, float const * const b, int const w, int const h, size_t const pitch,
+    int const r, float * outputImage, VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceSSE(l, a, b, w, h, pitch, r, blurred, &ctx); },
+      w, h, r, outputImage, NULL, NULL, context);
+}
+
+void vrd_sse(uint8_t const * const l, uint8_t const * const a, uint8_t const * const b, int const w, int const h, size_t const pitch,
+    int const r, float * outputImage, VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceSSE(l, a, b, w, h, pitch, r, blurred, &ctx); },
+      w, h, r, outputImage, NULL, NULL, context);
+}
+
+void vrd_sse(uint8_t const * const l, uint8_t const * const a, uint8_t const * const b, int const w, int const h, size_t const pitch,
+    int const r, float * outputImage, float * vGradient, float * hGradient, VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceSSE(l, a, b, w, h, pitch, r, blurred, &ctx); },
+      w, h, r, outputImage, vGradient, hGradient, context);
+}
+
+void vrd_rgb_sse(uint8_t const * const rgbImage, int const w, int const h, int const r, float * outputImage, VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceRGBSSE(rgbImage, w, h, r, blurred, &ctx); },
+      w, h, r, outputImage, NULL, NULL, context);
+}
+
+void vrd_rgb_sse(float const * const rgbImage, int const w, int const h, int const r, float * outputImage, VrdContext * context)
+{
+  vrdStagesSSE([&](VrdContext & ctx, float * blurred) { blurredVarianceRGBSSE(rgbImage, w, h, r, blurred, &ctx); },
+      w, h, r, outputImage, NULL, NULL, context);
+}
+
+//! Compute the integral and squared integral images of a LABX image with a single serial scan
+static void integralImageSSE(float const * const inputImage, int const w, int const h, float * const integral, float * const integral2)
+{
   int const w4 = 4*w;
-  int const xrigw = 4*(2*w-2-r);
-  int const yboth = w4*(2*h-2-r);
-  __m128 _norm = _mm_setzero_ps();
 
   // set the first row
   for(int i=0; i<4; ++i)
@@ -121,75 +699,212 @@ void blurredVarianceSSE(float const * const inputImage, int const w, int const h
       _mm_store_ps((float*)&integral2[(yw + x)*4], _reslt2);
     }
   }
+}
 
-  // compute the blur when y<r and x<r (top left corner) 
-  for (int y = 0; y < r;  y++)
-  {
-    int const ybot = w4*(y+r);
-    int const ytop = w4*abs(y-r);
-    float * outputrowptr = outputImage + y*w;
-
-    for (int x = 0; x < r; x++)
-    {
-      int const xrig = 4*(x+r);
-      int const xlef = 4*abs(x-r);
+//! Compute band-local integral images for the rows [y0, y1), as if row y0 were the first row of the image
+/*! Each row is accumulated as a running row sum added onto the row above, so a band only touches its own rows. */
+static void integralBandSSE(float const * const inputImage, int const w, int const y0, int const y1, float * const integral, float * const integral2)
+{
+  int const w4 = 4*w;
 
-      __m128 _toplef = _mm_load_ps( &integral[ xlef + ytop ] );
-      __m128 _toprig = _mm_load_ps( &integral[ xrig + ytop ] );
-      __m128 _botrig = _mm_load_ps( &integral[ xrig + ybot ] );
-      __m128 _botlef = _mm_load_ps( &integral[ xlef + ybot ] );
+  // the first row of the band is a plain running sum
+  __m128 _sum  = _mm_setzero_ps();
+  __m128 _sum2 = _mm_setzero_ps();
+  for (int x = 0; x < w; x++)
+  {
+    __m128 _curr = _mm_load_ps( &inputImage[ x*4 + w4*y0 ] );
 
-      _norm = _mm_set1_ps( (x+r)*(y+r) );
+    _sum  = _mm_add_ps(_sum, _curr);
+    _sum2 = _mm_add_ps(_sum2, _mm_mul_ps(_curr, _curr));
 
-      __m128 _reslt = _mm_sub_ps(_botrig, _botlef);
-      _reslt = _mm_sub_ps(_reslt, _toprig);
-      _reslt = _mm_add_ps(_reslt, _toplef);
-      _reslt = _mm_div_ps(_reslt, _norm);
+    _mm_store_ps(&integral[ x*4 + w4*y0 ], _sum);
+    _mm_store_ps(&integral2[ x*4 + w4*y0 ], _sum2);
+  }
 
-      // squared
-      __m128 _toplef2 = _mm_load_ps( &integral2[ xlef + ytop ] );
-      __m128 _toprig2 = _mm_load_ps( &integral2[ xrig + ytop ] );
-      __m128 _botrig2 = _mm_load_ps( &integral2[ xrig + ybot ] );
-      __m128 _botlef2 = _mm_load_ps( &integral2[ xlef + ybot ] );
+  // every other row adds its running sum onto the row above
+  for (int y = y0+1; y < y1; y++)
+  {
+    int const yw = w4*y;
+    int const y1w = w4*(y-1);
 
-      __m128 _reslt2 = _mm_sub_ps(_botrig2, _botlef2);
-      _reslt2 = _mm_sub_ps(_reslt2, _toprig2);
-      _reslt2 = _mm_add_ps(_reslt2, _toplef2);
-      _reslt2 = _mm_div_ps(_reslt2, _norm);
+    _sum  = _mm_setzero_ps();
+    _sum2 = _mm_setzero_ps();
+    for (int x = 0; x < w; x++)
+    {
+      __m128 _curr = _mm_load_ps( &inputImage[ x*4 + yw ] );
 
-      // output = integral2 - integral^2
-      __m128 _l2norm = _mm_sub_ps(_reslt2, _mm_mul_ps(_reslt, _reslt));
-      _l2norm = _mm_mul_ps(_l2norm, _l2norm);
+      _sum  = _mm_add_ps(_sum, _curr);
+      _sum2 = _mm_add_ps(_sum2, _mm_mul_ps(_curr, _curr));
 
-      *outputrowptr = sqrt(sqrt(hadd_ps(&_l2norm)));
-      outputrowptr++;
+      _mm_store_ps(&integral[ x*4 + yw ], _mm_add_ps(_mm_load_ps(&integral[ x*4 + y1w ]), _sum));
+      _mm_store_ps(&integral2[ x*4 + yw ], _mm_add_ps(_mm_load_ps(&integral2[ x*4 + y1w ]), _sum2));
     }
   }
+}
 
-  // compute the blur when y<r but x>2r (top edge)
-  for (int y = 0; y < r; y++)
+//! Stitch band-local integral images together into full integral images
+/*! The last row of each band is carried into the following bands serially (which only touches numBands rows), and a
+    parallel pass then adds the carry to every row of its band.
+    \param stride The number of floats in one row of the integral images
+    \param h The number of rows, which were split into numBands bands by parallelBands() */
+static void integralCarrySSE(float * const integral, float * const integral2, int const stride, int const h, int const numBands,
+    VrdContext & context)
+{
+  // carry[b] holds the final value of the row just above band b
+  float * const carry  = static_cast<float *>(context.buffer(CarryBuffer, sizeof(float) * stride * numBands));
+  float * const carry2 = static_cast<float *>(context.buffer(Carry2Buffer, sizeof(float) * stride * numBands));
+  for (int b = 1; b < numBands; b++)
   {
-    int const ybot = w4*(y+r);
+    int const ylast = stride*((h*b)/numBands - 1);
+    for (int x = 0; x < stride; x += 4)
+    {
+      __m128 _last  = _mm_load_ps(&integral[ ylast + x ]);
+      __m128 _last2 = _mm_load_ps(&integral2[ ylast + x ]);
+      if (b > 1)
+      {
+        _last  = _mm_add_ps(_last, _mm_load_ps(&carry[ stride*(b-1) + x ]));
+        _last2 = _mm_add_ps(_last2, _mm_load_ps(&carry2[ stride*(b-1) + x ]));
+      }
+      _mm_store_ps(&carry[ stride*b + x ], _last);
+      _mm_store_ps(&carry2[ stride*b + x ], _last2);
+    }
+  }
+
+  parallelBands(numBands, 0, h, [=](int y0, int y1)
+  {
+    if (y0 == 0) return;
+    int b = 1;
+    while ((h*b)/numBands != y0) b++;
+    float const * const c  = carry + stride*b;
+    float const * const c2 = carry2 + stride*b;
+    for (int y = y0; y < y1; y++)
+    {
+      for (int x = 0; x < stride; x += 4)
+      {
+        _mm_store_ps(&integral[ stride*y + x ], _mm_add_ps(_mm_load_ps(&integral[ stride*y + x ]), _mm_load_ps(&c[x])));
+        _mm_store_ps(&integral2[ stride*y + x ], _mm_add_ps(_mm_load_ps(&integral2[ stride*y + x ]), _mm_load_ps(&c2[x])));
+      }
+    }
+  });
+}
+
+//! Compute the integral images with a two pass row band scan
+/*! The first pass builds band-local integral images in parallel, which integralCarrySSE() then stitches together. */
+static void integralImageParallelSSE(float const * const inputImage, int const w, int const h, int const numBands,
+    float * const integral, float * const integral2, VrdContext & context)
+{
+  parallelBands(numBands, 0, h, [=](int y0, int y1) { integralBandSSE(inputImage, w, y0, y1, integral, integral2); });
+  integralCarrySSE(integral, integral2, 4*w, h, numBands, context);
+}
+
+//! Compute band-local rows [j0, j1) of the reflect padded integral images
+/*! The padded integral images have h+2r rows and w+2r columns of LABX sums. Entry (i, j) holds the sum of all
+    pixels above and to the left of image coordinate (i-r+1, j-r+1), with coordinates outside of the image mirrored
+    back in by reflect101(), which also folds the padding of radii past the image size. Row and column 0 are zero, so the 2r*2r box of output pixel (x, y) is always the four lookups at columns
+    x, x+2r and rows y, y+2r. The first row of a band is accumulated onto row 0 rather than onto the row above.
+    \param rowSource rowSource(y, rowBuffer) returns a pointer to LABX image row y, and may use the 4*w float
+           rowBuffer to produce it
+    \param scratch The band's bandScratchSize() bytes of scratch */
+template<class RowSource>
+static void paddedIntegralBandSSE(RowSource const & rowSource, int const w, int const h, int const r, int const j0, int const j1,
+    float * const integral, float * const integral2, char * const scratch)
+{
+  int const stride = 4*(w+2*r);
+  float * const rowBuffer = reinterpret_cast<float *>(scratch);
+  int * const colOffset = reinterpret_cast<int *>(scratch + sizeof(float) * 4 * w);
+
+  // offset of the mirrored source pixel for each padded column
+  for (int i = 1; i < w+2*r; i++)
+    colOffset[i] = 4*reflect101(i-r, w);
+
+  for (int j = j0; j < j1; j++)
+  {
+    float const * const inputrowptr = rowSource(reflect101(j-r, h), rowBuffer);
+    int const yabove = (j == j0) ? 0 : stride*(j-1);
+    int const yw = stride*j;
+
+    __m128 _sum  = _mm_setzero_ps();
+    __m128 _sum2 = _mm_setzero_ps();
+    _mm_store_ps(&integral[yw], _sum);
+    _mm_store_ps(&integral2[yw], _sum2);
+
+    for (int i = 1; i < w+2*r; i++)
+    {
+      __m128 _curr = _mm_load_ps( &inputrowptr[ colOffset[i] ] );
+
+      _sum  = _mm_add_ps(_sum, _curr);
+      _sum2 = _mm_add_ps(_sum2, _mm_mul_ps(_curr, _curr));
+
+      _mm_store_ps(&integral[ yw + 4*i ], _mm_add_ps(_mm_load_ps(&integral[ yabove + 4*i ]), _sum));
+      _mm_store_ps(&integral2[ yw + 4*i ], _mm_add_ps(_mm_load_ps(&integral2[ yabove + 4*i ]), _sum2));
+    }
+  }
+}
+
+//! Compute the blurred variance for the output rows [yBegin, yEnd) from the reflect padded integral images
+/*! Every box is a full 2r*2r box in the padded domain, so there are no border cases and a single normalization. */
+static void blurRowsPaddedSSE(float const * const integral, float const * const integral2, int const w, int const r,
+    float * outputImage, int const yBegin, int const yEnd)
+{
+  int const stride = 4*(w+2*r);
+  VrdKernels const * const kernels = vrdKernels();
+
+  for (int y = yBegin; y < yEnd; y++)
+  {
+    int const ytop = stride*y;
+    int const ybot = stride*(y+2*r);
+
+    kernels->varianceRow(integral + ytop, integral + ybot, integral2 + ytop, integral2 + ybot, 8*r, 4*r*r,
+        outputImage + y*w, w);
+  }
+}
+
+//! Compute the blurred variance for the output rows [yBegin, yEnd) from the integral images
+static void blurRowsSSE(float const * const integral, float const * const integral2, int const w, int const h, int const r,
+    float * outputImage, int const yBegin, int const yEnd)
+{
+  // pre-compute some constants used below
+  int const norm_2r = 2*r;
+  int const norm_2r2 = 2*r*r;
+  int const norm_r2 = r*r;
+  int const norm_w1r = w+r-1;
+  int const norm_h1r = h+r-1;
+  int const w4 = 4*w;
+  int const xrigw = 4*(2*w-2-r);
+  int const yboth = w4*(2*h-2-r);
+  __m128 _norm = _mm_setzero_ps();
+
+  // clip the top, middle and bottom regions to the requested rows
+  int const topEnd   = std::min(r, yEnd);
+  int const midBegin = std::max(r, yBegin);
+  int const midEnd   = std::min(h-r, yEnd);
+  int const botBegin = std::max(h-r, yBegin);
+
+  // compute the blur when y<r and x<r (top left corner) 
+  for (int y = yBegin; y < topEnd; y++)
+  {
+    int const ybot = w4*(y+r);
     int const ytop = w4*abs(y-r);
     float * outputrowptr = outputImage + y*w;
 
-    for (int x = r; x < w-r; x++)
+    for (int x = 0; x < r; x++)
     {
-      int const xlef = 4*(x-r);
       int const xrig = 4*(x+r);
+      int const xlef = 4*abs(x-r);
 
       __m128 _toplef = _mm_load_ps( &integral[ xlef + ytop ] );
       __m128 _toprig = _mm_load_ps( &integral[ xrig + ytop ] );
       __m128 _botrig = _mm_load_ps( &integral[ xrig + ybot ] );
       __m128 _botlef = _mm_load_ps( &integral[ xlef + ybot ] );
 
-      _norm = _mm_set1_ps( y * norm_2r + norm_2r2 );
+      _norm = _mm_set1_ps( (x+r)*(y+r) );
 
       __m128 _reslt = _mm_sub_ps(_botrig, _botlef);
       _reslt = _mm_sub_ps(_reslt, _toprig);
       _reslt = _mm_add_ps(_reslt, _toplef);
       _reslt = _mm_div_ps(_reslt, _norm);
 
+      // squared
       __m128 _toplef2 = _mm_load_ps( &integral2[ xlef + ytop ] );
       __m128 _toprig2 = _mm_load_ps( &integral2[ xrig + ytop ] );
       __m128 _botrig2 = _mm_load_ps( &integral2[ xrig + ybot ] );
@@ -209,12 +924,41 @@ void blurredVarianceSSE(float const * const inputImage, int const w, int const h
     }
   }
 
+  // compute the blur when y<r but x>2r (top edge)
+  for (int y = yBegin; y < topEnd; y++)
+  {
+    int const ybot = w4*(y+r);
+    int const ytop = w4*abs(y-r);
+    float * outputrowptr = outputImage + y*w + r;
+
+    _norm = _mm_set1_ps( y * norm_2r + norm_2r2 );
+
+    int x = r;
+    for (; x + 4 <= w-r; x += 4)
+    {
+      __m128 _l2norm0 = boxVariance2_ps(integral, integral2, 4*(x-r),   4*(x+r),   ytop, ybot, _norm);
+      __m128 _l2norm1 = boxVariance2_ps(integral, integral2, 4*(x+1-r), 4*(x+1+r), ytop, ybot, _norm);
+      __m128 _l2norm2 = boxVariance2_ps(integral, integral2, 4*(x+2-r), 4*(x+2+r), ytop, ybot, _norm);
+      __m128 _l2norm3 = boxVariance2_ps(integral, integral2, 4*(x+3-r), 4*(x+3+r), ytop, ybot, _norm);
+
+      _mm_storeu_ps(outputrowptr, _mm_sqrt_ps(_mm_sqrt_ps(hadd4_ps(_l2norm0, _l2norm1, _l2norm2, _l2norm3))));
+      outputrowptr += 4;
+    }
+    for (; x < w-r; x++)
+    {
+      __m128 _l2norm = boxVariance2_ps(integral, integral2, 4*(x-r), 4*(x+r), ytop, ybot, _norm);
+
+      *outputrowptr = sqrt(sqrt(hadd_ps(&_l2norm)));
+      outputrowptr++;
+    }
+  }
+
   // compute the blur when y<r and x>(w-r) (top right corner) 
-  for (int y = 0; y < r; y++)
+  for (int y = yBegin; y < topEnd; y++)
   {
     int const ybot = w4*(y+r);
     int const ytop = w4*abs(y-r);
-    float * outputrowptr = outputImage + y*w;
+    float * outputrowptr = outputImage + y*w + w-r;
 
     for (int x = w-r; x < w; x++)
     {
@@ -253,7 +997,7 @@ void blurredVarianceSSE(float const * const inputImage, int const w, int const h
   }
 
   // compute the blur when y>r and x<r (left edge)
-  for (int y = r; y < h-r; y++)
+  for (int y = midBegin; y < midEnd; y++)
   {
     int const ytop = w4*(y-r);
     int const ybot = w4*(y+r);
@@ -296,7 +1040,7 @@ void blurredVarianceSSE(float const * const inputImage, int const w, int const h
   }
 
   // compute the blur when y>(h-r) and x<r (bottom left corner)
-  for (int y = h-r; y < h; y++)
+  for (int y = botBegin; y < yEnd; y++)
   {
     int const ytop = w4*(y-r);
     int const ybot = yboth - y*w4;
@@ -339,43 +1083,28 @@ void blurredVarianceSSE(float const * const inputImage, int const w, int const h
   }
 
   // compute the blur when y>(h-r) and x>r (bottom edge)
-  for (int y = h-r; y < h; y++)
+  for (int y = botBegin; y < yEnd; y++)
   {
     int const ytop = w4*(y-r);
     int const ybot = yboth - y*w4; 
-    float * outputrowptr = outputImage + y*w;
-
-    for (int x = r; x < w-r; x++)
-    {
-      int const xlef = 4*(x-r);
-      int const xrig = 4*(x+r);
-
-      __m128 _toplef = _mm_load_ps( &integral[ xlef + ytop ] );
-      __m128 _toprig = _mm_load_ps( &integral[ xrig + ytop ] );
-      __m128 _botrig = _mm_load_ps( &integral[ xrig + ybot ] );
-      __m128 _botlef = _mm_load_ps( &integral[ xlef + ybot ] );
-
-      _norm = _mm_set1_ps( (norm_h1r-y)*norm_2r );
-
-      __m128 _reslt = _mm_sub_ps(_botrig, _botlef);
-      _reslt = _mm_sub_ps(_reslt, _toprig);
-      _reslt = _mm_add_ps(_reslt, _toplef);
-      _reslt = _mm_div_ps(_reslt, _norm);
+    float * outputrowptr = outputImage + y*w + r;
 
+    _norm = _mm_set1_ps( (norm_h1r-y)*norm_2r );
 
-      __m128 _toplef2 = _mm_load_ps( &integral2[ xlef + ytop ] );
-      __m128 _toprig2 = _mm_load_ps( &integral2[ xrig + ytop ] );
-      __m128 _botrig2 = _mm_load_ps( &integral2[ xrig + ybot ] );
-      __m128 _botlef2 = _mm_load_ps( &integral2[ xlef + ybot ] );
-
-      __m128 _reslt2 = _mm_sub_ps(_botrig2, _botlef2);
-      _reslt2 = _mm_sub_ps(_reslt2, _toprig2);
-      _reslt2 = _mm_add_ps(_reslt2, _toplef2);
-      _reslt2 = _mm_div_ps(_reslt2, _norm);
+    int x = r;
+    for (; x + 4 <= w-r; x += 4)
+    {
+      __m128 _l2norm0 = boxVariance2_ps(integral, integral2, 4*(x-r),   4*(x+r),   ytop, ybot, _norm);
+      __m128 _l2norm1 = boxVariance2_ps(integral, integral2, 4*(x+1-r), 4*(x+1+r), ytop, ybot, _norm);
+      __m128 _l2norm2 = boxVariance2_ps(integral, integral2, 4*(x+2-r), 4*(x+2+r), ytop, ybot, _norm);
+      __m128 _l2norm3 = boxVariance2_ps(integral, integral2, 4*(x+3-r), 4*(x+3+r), ytop, ybot, _norm);
 
-      // output = integral2 - integral^2
-      __m128 _l2norm = _mm_sub_ps(_reslt2, _mm_mul_ps(_reslt, _reslt));
-      _l2norm = _mm_mul_ps(_l2norm, _l2norm);
+      _mm_storeu_ps(outputrowptr, _mm_sqrt_ps(_mm_sqrt_ps(hadd4_ps(_l2norm0, _l2norm1, _l2norm2, _l2norm3))));
+      outputrowptr += 4;
+    }
+    for (; x < w-r; x++)
+    {
+      __m128 _l2norm = boxVariance2_ps(integral, integral2, 4*(x-r), 4*(x+r), ytop, ybot, _norm);
 
       *outputrowptr = sqrt(sqrt(hadd_ps(&_l2norm)));
       outputrowptr++;
@@ -383,11 +1112,11 @@ void blurredVarianceSSE(float const * const inputImage, int const w, int const h
   }
 
   // compute the blur when y>(h-r) and x>(w-r) (bottom right corner)
-  for (int y = h-r; y < h; y++)
+  for (int y = botBegin; y < yEnd; y++)
   {
     int const ytop = w4*(y-r);
     int const ybot = yboth - y*w4; 
-    float * outputrowptr = outputImage + y*w;
+    float * outputrowptr = outputImage + y*w + w-r;
 
     for (int x = w-r; x < w; x++)
     {
@@ -426,11 +1155,11 @@ void blurredVarianceSSE(float const * const inputImage, int const w, int const h
   }
 
   // compute the blur when y>r and x>(w-r) (right edge)    
-  for (int y = r; y < h-r; y++)
+  for (int y = midBegin; y < midEnd; y++)
   {
     int const ytop = w4*(y-r);
     int const ybot = w4*(y+r);
-    float * outputrowptr = outputImage + y*w;
+    float * outputrowptr = outputImage + y*w + w-r;
 
     for (int x = w-r; x < w; x++)
     {
@@ -468,178 +1197,1203 @@ void blurredVarianceSSE(float const * const inputImage, int const w, int const h
     }
   }
 
-  // compute the blur on the rest of the image
-  _norm = _mm_set1_ps( 4*r*r ); 
-  for (int y = r; y < h-r; y++)
+  // compute the blur on the rest of the image with the widest kernel available
+  VrdKernels const * const kernels = vrdKernels();
+  for (int y = midBegin; y < midEnd; y++)
   {
     int const ytop = w4*(y-r);
     int const ybot = w4*(y+r);
 
-    float * outputrowptr = outputImage + y*w + r; 
+    kernels->varianceRow(integral + ytop, integral + ybot, integral2 + ytop, integral2 + ybot, 8*r, 4*r*r,
+        outputImage + y*w + r, w-2*r);
+  }
+}
+
+//! Compute the blurred variance for the output rows [yBegin, yEnd) with rolling column and row sums
+/*! The column sums hold the 2r rows of the current window, and are updated by adding the row entering the window and
+    subtracting the row leaving it. Each output row is then a sliding 2r wide sum across the column sums. Rows and
+    columns outside of the image are mirrored back in, so every pixel uses the same 4*r*r normalization.
+    \param inputImage The input rows from image row inputRow0 on
+    \param outputImage The output rows from image row outputRow0 on
+    \param scratch The band's bandScratchSize() bytes of scratch, which hold the column sums
+    \param resume Whether scratch still holds the column sums of row yBegin-1 from the previous call, in which case
+                  they are slid on instead of primed, and the rows above yBegin-r are not read */
+static void blurRowsRollingSSE(float const * const inputImage, int const inputRow0, int const w, int const h, int const r,
+    float * outputImage, int const outputRow0, int const yBegin, int const yEnd, char * const scratch, bool const resume)
+{
+  int const w4 = 4*w;
+  float * const colSum  = reinterpret_cast<float *>(scratch);
+  float * const colSum2 = colSum + w4;
+  __m128 const _norm = _mm_set1_ps( 4*r*r );
 
-    for (int x = r; x < w-r; x++)
+  // prime the column sums with the window of the first output row
+  if (!resume)
+  {
+    for (int x = 0; x < w4; x += 4)
     {
-      int const xlef = 4*(x-r);
-      int const xrig = 4*(x+r);
+      _mm_store_ps(&colSum[x], _mm_setzero_ps());
+      _mm_store_ps(&colSum2[x], _mm_setzero_ps());
+    }
+    for (int j = yBegin-r+1; j <= yBegin+r; j++)
+    {
+      float const * const inputrowptr = inputImage + w4*(reflect101(j, h) - inputRow0);
+      for (int x = 0; x < w4; x += 4)
+      {
+        __m128 _curr = _mm_load_ps(&inputrowptr[x]);
+        _mm_store_ps(&colSum[x], _mm_add_ps(_mm_load_ps(&colSum[x]), _curr));
+        _mm_store_ps(&colSum2[x], _mm_add_ps(_mm_load_ps(&colSum2[x]), _mm_mul_ps(_curr, _curr)));
+      }
+    }
+  }
 
-      __m128 _toplef = _mm_load_ps( &integral[ xlef + ytop ] );
-      __m128 _toprig = _mm_load_ps( &integral[ xrig + ytop ] );
-      __m128 _botrig = _mm_load_ps( &integral[ xrig + ybot ] );
-      __m128 _botlef = _mm_load_ps( &integral[ xlef + ybot ] );
+  for (int y = yBegin; y < yEnd; y++)
+  {
+    // slide the window down by one row
+    if (y > yBegin || resume)
+    {
+      float const * const enterrowptr = inputImage + w4*(reflect101(y+r, h) - inputRow0);
+      float const * const leaverowptr = inputImage + w4*(reflect101(y-r, h) - inputRow0);
+      for (int x = 0; x < w4; x += 4)
+      {
+        __m128 _enter = _mm_load_ps(&enterrowptr[x]);
+        __m128 _leave = _mm_load_ps(&leaverowptr[x]);
 
-      __m128 _reslt = _mm_sub_ps(_botrig, _botlef);
-      _reslt = _mm_sub_ps(_reslt, _toprig);
-      _reslt = _mm_add_ps(_reslt, _toplef);
-      _reslt = _mm_div_ps(_reslt, _norm);
+        __m128 _col = _mm_add_ps(_mm_load_ps(&colSum[x]), _enter);
+        _mm_store_ps(&colSum[x], _mm_sub_ps(_col, _leave));
 
-      //_mm_store_ps((float*)&output_ptr[4*(yw + x)], _reslt);
+        __m128 _col2 = _mm_add_ps(_mm_load_ps(&colSum2[x]), _mm_mul_ps(_enter, _enter));
+        _mm_store_ps(&colSum2[x], _mm_sub_ps(_col2, _mm_mul_ps(_leave, _leave)));
+      }
+    }
 
-      /* squared */
-      __m128 _toplef2 = _mm_load_ps( &integral2[ xlef + ytop ] );
-      __m128 _toprig2 = _mm_load_ps( &integral2[ xrig + ytop ] );
-      __m128 _botrig2 = _mm_load_ps( &integral2[ xrig + ybot ] );
-      __m128 _botlef2 = _mm_load_ps( &integral2[ xlef + ybot ] );
+    // slide a 2r wide window across the column sums
+    __m128 _sum  = _mm_setzero_ps();
+    __m128 _sum2 = _mm_setzero_ps();
+    for (int i = -r+1; i <= r; i++)
+    {
+      _sum  = _mm_add_ps(_sum, _mm_load_ps(&colSum[ 4*reflect101(i, w) ]));
+      _sum2 = _mm_add_ps(_sum2, _mm_load_ps(&colSum2[ 4*reflect101(i, w) ]));
+    }
 
-      __m128 _reslt2 = _mm_sub_ps(_botrig2, _botlef2);
-      _reslt2 = _mm_sub_ps(_reslt2, _toprig2);
-      _reslt2 = _mm_add_ps(_reslt2, _toplef2);
-      _reslt2 = _mm_div_ps(_reslt2, _norm);
+    // slide the window to column x and compute its squared variance
+    auto slideTo = [&](int const x) -> __m128
+    {
+      if (x > 0)
+      {
+        int const xrig = 4*reflect101(x+r, w);
+        int const xlef = 4*reflect101(x-r, w);
+        _sum  = _mm_sub_ps(_mm_add_ps(_sum, _mm_load_ps(&colSum[xrig])), _mm_load_ps(&colSum[xlef]));
+        _sum2 = _mm_sub_ps(_mm_add_ps(_sum2, _mm_load_ps(&colSum2[xrig])), _mm_load_ps(&colSum2[xlef]));
+      }
 
-      // output = integral2 - integral^2
+      __m128 _reslt  = _mm_div_ps(_sum, _norm);
+      __m128 _reslt2 = _mm_div_ps(_sum2, _norm);
 
+      // output = integral2 - integral^2
       __m128 _l2norm = _mm_sub_ps(_reslt2, _mm_mul_ps(_reslt, _reslt));
-      _l2norm = _mm_mul_ps(_l2norm, _l2norm);
+      return _mm_mul_ps(_l2norm, _l2norm);
+    };
+
+    float * outputrowptr = outputImage + (y - outputRow0)*w;
+    int x = 0;
+    for (; x + 4 <= w; x += 4)
+    {
+      __m128 _l2norm0 = slideTo(x);
+      __m128 _l2norm1 = slideTo(x+1);
+      __m128 _l2norm2 = slideTo(x+2);
+      __m128 _l2norm3 = slideTo(x+3);
+
+      _mm_storeu_ps(outputrowptr, _mm_sqrt_ps(hadd4_ps(_l2norm0, _l2norm1, _l2norm2, _l2norm3)));
+      outputrowptr += 4;
+    }
+    for (; x < w; x++)
+    {
+      __m128 _l2norm = slideTo(x);
 
       *outputrowptr = sqrt(hadd_ps(&_l2norm));
       outputrowptr++;
-      //_mm_store_ps((float*)&output_ptr[4*(yw + x)], _reslt);
     }
   }
+}
+
+//! Calculate the blurred variance with the PaddedIntegral engine, reading the LABX rows from rowSource
+/*! \param rowSource See paddedIntegralBandSSE() */
+template<class RowSource>
+static void blurredVariancePaddedSSE(RowSource const & rowSource, int const w, int const h, int const r, float * outputImage,
+    VrdContext & context)
+{
+  int const numThreads = std::min(stageThreads(), h);
+  int const stride = 4*(w+2*r);
+  int const paddedh = h+2*r;
+  float * const integral  = static_cast<float *>(context.buffer(IntegralBuffer, sizeof(float) * stride * paddedh));
+  float * const integral2 = static_cast<float *>(context.buffer(Integral2Buffer, sizeof(float) * stride * paddedh));
+
+  // row 0 stays zero, the remaining rows are built in bands and stitched together
+  memset(integral, 0, sizeof(float) * stride);
+  memset(integral2, 0, sizeof(float) * stride);
+  int const numBands = std::min(numThreads, paddedh-1);
+  bandScratch(context, w, r, numBands, 0);
+  parallelBandsIndexed(numBands, 1, paddedh, [&](int b, int j0, int j1)
+  {
+    paddedIntegralBandSSE(rowSource, w, h, r, j0, j1, integral, integral2, bandScratch(context, w, r, numBands, b));
+  });
+  integralCarrySSE(integral + stride, integral2 + stride, stride, paddedh-1, numBands, context);
 
-  free(integral);
-  free(integral2);
+  parallelTiles(numThreads, 0, h, tileRowsFor(h, numThreads, 8), [=](int, int y0, int y1)
+  {
+    blurRowsPaddedSSE(integral, integral2, w, r, outputImage, y0, y1);
+  });
 }
 
-void calculateGradientSSE(float const * const inputImage, int const w, int const h, int const r, float * gradX, float * gradY)
+//! Convert four RGB pixels (in the 0-255 range) to LABX, with the same formulas as PixLABX::fromRGB()
+static inline void rgbToLABX4SSE(__m128 const _r, __m128 const _g, __m128 const _b, float * const labx)
 {
-  float dx[NUM_GRADIENT_DIRECTIONS];
-  float dy[NUM_GRADIENT_DIRECTIONS];
-  float rdxdy[NUM_GRADIENT_DIRECTIONS*4];
+  __m128 _L, _A, _B;
+  nrt::labsse::fromRGB(_r, _g, _b, _L, _A, _B);
+  __m128 _X0 = _mm_setzero_ps();
+
+  // planar L, a, b, x to four interleaved LABX pixels
+  _MM_TRANSPOSE4_PS(_L, _A, _B, _X0);
+  _mm_store_ps(labx,      _L);
+  _mm_store_ps(labx + 4,  _A);
+  _mm_store_ps(labx + 8,  _B);
+  _mm_store_ps(labx + 12, _X0);
+}
 
-  float const pi2 = 2.0f*M_PI;
-  float const norm = 1/float(NUM_GRADIENT_DIRECTIONS);
+//! Convert a row of n interleaved RGB pixels to LABX, four pixels at a time
+template<class T>
+static void rgbRowToLABXSSE(T const * const rgb, int const n, float * const labx)
+{
+  int x = 0;
+  for (; x + 4 <= n; x += 4)
+  {
+    T const * const p = rgb + 3*x;
+    rgbToLABX4SSE(_mm_set_ps(float(p[9]),  float(p[6]), float(p[3]), float(p[0])),
+                  _mm_set_ps(float(p[10]), float(p[7]), float(p[4]), float(p[1])),
+                  _mm_set_ps(float(p[11]), float(p[8]), float(p[5]), float(p[2])), labx + 4*x);
+  }
+
+  // pad the last few pixels out to a full vector
+  if (x < n)
+  {
+    float tail[3*4] = { 0 };
+    for (int i = 0; i < 3*(n-x); i++)
+      tail[i] = float(rgb[3*x + i]);
+
+    float tailLABX[4*4] __attribute__((aligned(16)));
+    rgbToLABX4SSE(_mm_set_ps(tail[9],  tail[6], tail[3], tail[0]),
+                  _mm_set_ps(tail[10], tail[7], tail[4], tail[1]),
+                  _mm_set_ps(tail[11], tail[8], tail[5], tail[2]), tailLABX);
+    memcpy(labx + 4*x, tailLABX, sizeof(float) * 4 * (n-x));
+  }
+}
 
-  /* pre-load r*dx and r*dy */
-  for (int k = 0; k < NUM_GRADIENT_DIRECTIONS; k++)
+//! blurredVarianceRGBSSE() for either input type
+template<class T>
+static void blurredVarianceRGBImplSSE(T const * const rgbImage, int const w, int const h, int const r, float * outputImage,
+    VrdContext * context)
+{
+  VrdContext localContext;
+  blurredVariancePaddedSSE([=](int y, float * rowBuffer)
   {
-    float const idx = pi2*float(k)*norm;
-    dx[k] = cos(idx);
-    dy[k] = sin(idx);
+    rgbRowToLABXSSE(rgbImage + 3*w*y, w, rowBuffer);
+    return (float const *)rowBuffer;
+  }, w, h, r, outputImage, context ? *context : localContext);
+}
 
-    rdxdy[4*k + 0] = int(+r*dx[k]);
-    rdxdy[4*k + 1] = int(+r*dy[k]);
-    rdxdy[4*k + 2] = int(-r*dx[k]);
-    rdxdy[4*k + 3] = int(-r*dy[k]);
+void blurredVarianceRGBSSE(uint8_t const * const rgbImage, int const w, int const h, int const r, float * outputImage,
+    VrdContext * context)
+{
+  blurredVarianceRGBImplSSE(rgbImage, w, h, r, outputImage, context);
+}
+
+void blurredVarianceRGBSSE(float const * const rgbImage, int const w, int const h, int const r, float * outputImage,
+    VrdContext * context)
+{
+  blurredVarianceRGBImplSSE(rgbImage, w, h, r, outputImage, context);
+}
+
+void blurredVarianceSSE(float const * const inputImage, int const w, int const h, int const r, float * outputImage, VrdContext * context)
+{
+  VrdContext localContext;
+  VrdContext & ctx = context ? *context : localContext;
+  int const numThreads = std::min(stageThreads(), h);
+
+  if (vrdBlurEngine == BlurEngine::Rolling)
+  {
+    bandScratch(ctx, w, r, numThreads, 0);
+    parallelBandsIndexed(numThreads, 0, h, [&](int b, int y0, int y1)
+    {
+      blurRowsRollingSSE(inputImage, 0, w, h, r, outputImage, 0, y0, y1, bandScratch(ctx, w, r, numThreads, b), false);
+    });
+    return;
   }
-  /* now data starting at rdxdy[k] contains: (rdx[k], rdy[k], -rdx[k], -rdy[k]) */
 
-  __m128 _clamp = _mm_set_ps(h-2, w-2, h-2, w-2);
-  __m128 _1w1w = _mm_set_ps(w, 1, w, 1);
-  __m128 _signmask = _mm_set1_ps(-0.f);
+  if (vrdBlurEngine == BlurEngine::PaddedIntegral)
+  {
+    blurredVariancePaddedSSE([=](int y, float *) { return inputImage + 4*w*y; }, w, h, r, outputImage, ctx);
+    return;
+  }
 
-  float ij[4];
+  float * const integral  = static_cast<float *>(ctx.buffer(IntegralBuffer, sizeof(float) * w * h * 4));
+  float * const integral2 = static_cast<float *>(ctx.buffer(Integral2Buffer, sizeof(float) * w * h * 4));
 
-  for (int j = 0; j < h; j++)
+  if (numThreads == 1)
+  {
+    integralImageSSE(inputImage, w, h, integral, integral2);
+    blurRowsSSE(integral, integral2, w, h, r, outputImage, 0, h);
+  }
+  else
   {
-    for (int i = 0; i < w; i++)
+    integralImageParallelSSE(inputImage, w, h, numThreads, integral, integral2, ctx);
+    parallelTiles(numThreads, 0, h, tileRowsFor(h, numThreads, 8), [=](int, int y0, int y1)
     {
-      float sumX = 0.0;
-      float sumY = 0.0;
+      blurRowsSSE(integral, integral2, w, h, r, outputImage, y0, y1);
+    });
+  }
+}
+
+//! Fold one radius' edge map into the running maximum over radii, or start it when first is set
+static void scaleMaxSSE(float const * const scale, int const n, bool const first, float * maxOutput)
+{
+  if (first)
+  {
+    if (maxOutput != scale)
+      memcpy(maxOutput, scale, sizeof(float) * n);
+    return;
+  }
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(maxOutput + i, _mm_max_ps(_mm_loadu_ps(maxOutput + i), _mm_loadu_ps(scale + i)));
+  for (; i < n; i++)
+    maxOutput[i] = std::max(maxOutput[i], scale[i]);
+}
+
+void vrd_sse_multi(float const * const inputImage, int const w, int const h, int const * const radii, int const n,
+    float * const * outputs, float * maxOutput, VrdContext * context)
+{
+  VrdContext localContext;
+  VrdContext & ctx = context ? *context : localContext;
+  int const numThreads = std::min(stageThreads(), h);
+  bool const shared = vrdBlurEngine == BlurEngine::IntegralImage;
+
+  float * integral = NULL;
+  float * integral2 = NULL;
+  if (shared)
+  {
+    integral  = static_cast<float *>(ctx.buffer(IntegralBuffer, sizeof(float) * w * h * 4));
+    integral2 = static_cast<float *>(ctx.buffer(Integral2Buffer, sizeof(float) * w * h * 4));
+    if (numThreads == 1)
+      integralImageSSE(inputImage, w, h, integral, integral2);
+    else
+      integralImageParallelSSE(inputImage, w, h, numThreads, integral, integral2, ctx);
+  }
+
+  for (int i = 0; i < n; i++)
+  {
+    int const r = radii[i];
+    float * const output = outputs ? outputs[i] : static_cast<float *>(ctx.buffer(ScaleBuffer, sizeof(float) * w * h));
 
-      for (int k = 0; k < NUM_GRADIENT_DIRECTIONS; k++)
+    if (shared)
+      vrdStagesSSE([=](VrdContext &, float * blurred)
       {
-        /* load (r*dx, r*dy, -r*dx, -r*dy) into an SSE reg */
-        __m128 _rdxdy = _mm_load_ps(&rdxdy[4*k]); 
+        parallelTiles(numThreads, 0, h, tileRowsFor(h, numThreads, 8), [=](int, int y0, int y1)
+        {
+          blurRowsSSE(integral, integral2, w, h, r, blurred, y0, y1);
+        });
+      }, w, h, r, output, NULL, NULL, &ctx);
+    else
+      vrd_sse(inputImage, w, h, r, output, &ctx);
+
+    if (maxOutput)
+      scaleMaxSSE(output, w*h, i == 0, maxOutput);
+  }
+}
 
-        /* set _ij = (i, j, i, j) */
-        __m128 _ij = _mm_set_ps(j, i, j, i);
+//! The largest image, in pixels, that vrd_sse_batch() runs whole on one thread rather than tiled across all of them
+/*! Each worker keeps its own scratch, 32 bytes per pixel for the integral images, so much larger images are better
+    off sharing one context and running one after another on every thread. */
+static size_t const batchWholeImagePixels = 1 << 20;
 
-        /* _ij = (i+rdx, j+rdy, i-rdx, j-rdx) */
-        _ij = _mm_add_ps(_ij, _rdxdy);
+void vrd_sse_batch(float const * const * inputImages, int const * widths, int const * heights, int const n, int const r,
+    float * const * outputImages, VrdContext * context, float * skippedFractions)
+{
+  VrdContext localContext;
+  VrdContext & ctx = context ? *context : localContext;
+  int const numThreads = stageThreads();
 
-        /* _ij = abs( (i+rdx, j+rdy, i-rdx, j-rdx) ) */
-        _ij = _mm_andnot_ps(_signmask, _ij);
+  // large images, and every image on a single thread, go one after another through the one context
+  std::vector<int> whole;
+  for (int i = 0; i < n; i++)
+  {
+    if (numThreads > 1 && size_t(widths[i]) * heights[i] <= batchWholeImagePixels)
+      whole.push_back(i);
+    else
+    {
+      vrd_sse(inputImages[i], widths[i], heights[i], r, outputImages[i], &ctx);
+      if (skippedFractions)
+        skippedFractions[i] = ctx.flatSkippedFraction();
+    }
+  }
+  if (whole.empty())
+    return;
 
-        /* clamp values inside _ij */
-        _ij = _mm_min_ps(_clamp, _ij);
+  // the rest are shared out largest first, which evens out the load when the sizes are mixed
+  std::stable_sort(whole.begin(), whole.end(), [&](int const a, int const b)
+  {
+    return size_t(widths[a]) * heights[a] > size_t(widths[b]) * heights[b];
+  });
 
-        /* reshape the coords in _ij into 1d */
-        _ij = _mm_mul_ps(_ij, _1w1w);
+  std::unique_ptr<VrdContext[]> workerContexts(new VrdContext[numThreads - 1]);
+  parallelTiles(numThreads, 0, int(whole.size()), 1, [&](int t, int k0, int k1)
+  {
+    VrdContext & workerContext = t == 0 ? ctx : workerContexts[t-1];
+    vrdSerialWorker = true;
+    for (int k = k0; k < k1; k++)
+    {
+      int const i = whole[k];
+      vrd_sse(inputImages[i], widths[i], heights[i], r, outputImages[i], &workerContext);
+      if (skippedFractions)
+        skippedFractions[i] = workerContext.flatSkippedFraction();
+    }
+    vrdSerialWorker = false;
+  });
+}
 
-        /* store _ij back into a regular float array: ij = j2 i2 j1 i1 */ 
-        _mm_store_ps(ij, _ij);
+//! The number of input rows VrdStream::push() appends to its window before running the stages on them
+static int const streamChunkRows = 32;
 
-        float val = inputImage[int(ij[0] + ij[1])] - inputImage[int(ij[2]+ij[3])];
+VrdStream::VrdStream(int const w, int const r) :
+  w(w), r(r), windowRows(2*(streamChunkRows + latency())),
+  rowsIn(0), inputRow0(0), blurRow0(0), gradRow0(0), nextBlur(0), nextGrad(0), nextRidge(0)
+{
+  // the windows are sized once here, so that buffer() never reallocates them and drops the rows they hold
+  context.buffer(InputBuffer, sizeof(float) * 4 * w * windowRows);
+  context.buffer(BlurBuffer, sizeof(float) * w * windowRows);
+  context.buffer(GradXBuffer, sizeof(float) * w * windowRows);
+  context.buffer(GradYBuffer, sizeof(float) * w * windowRows);
+  context.buffer(BandBuffer, bandScratchSize(w, r));
+}
 
-        sumX += val * dx[k];
-        sumY += val * dy[k];
+int VrdStream::latency() const
+{
+  return 3*r + 4;
+}
+
+int VrdStream::push(float const * const inputRows, int const n, float * outputRows)
+{
+  float * const input = static_cast<float *>(context.buffer(InputBuffer, 0));
+  int written = 0;
+
+  for (int y = 0; y < n; y += streamChunkRows)
+  {
+    int const rows = std::min(streamChunkRows, n - y);
+    memcpy(input + 4*w*(rowsIn - inputRow0), inputRows + 4*w*y, sizeof(float) * 4 * w * rows);
+    rowsIn += rows;
+
+    written += process(rowsIn, false, outputRows + w*written);
+  }
+  return written;
+}
+
+int VrdStream::finish(float * outputRows)
+{
+  int const written = rowsIn > 0 ? process(rowsIn, true, outputRows) : 0;
+
+  rowsIn = inputRow0 = blurRow0 = gradRow0 = 0;
+  nextBlur = nextGrad = nextRidge = 0;
+  return written;
+}
+
+/*! Until the frame is complete its bottom border is unknown, so each stage only runs on the rows whose samples are
+    all real rows: the samples of the blur reach r rows down and those of the gradient and ridge r+2 rows, since
+    clampCoord() already clamps the row before the last. Passing the rows available so far as the height then gives
+    the same results as the full frame. The kernels read rows as contiguous strides, so the windows are not rings:
+    once a window runs short of room for the rows of another call, the rows that no later row samples are dropped
+    from its top with memmove(). Those are at most 2r+2 rows, and the windows are big enough that this happens only
+    every few dozen rows. */
+int VrdStream::process(int const h, bool const last, float * outputRows)
+{
+  VrdKernels const * const kernels = vrdKernels();
+  int const d = directionIndex(vrdNumDirections);
+  int const ri = vrdSpecializeRadii ? radiusIndex(r) : 0;
+
+  float * const input = static_cast<float *>(context.buffer(InputBuffer, 0));
+  float * const blurred = static_cast<float *>(context.buffer(BlurBuffer, 0));
+  float * const gradX = static_cast<float *>(context.buffer(GradXBuffer, 0));
+  float * const gradY = static_cast<float *>(context.buffer(GradYBuffer, 0));
+  char * const scratch = static_cast<char *>(context.buffer(BandBuffer, 0));
+
+  int const blurEnd = last ? h : std::max(nextBlur, h - r);
+  if (blurEnd > nextBlur)
+  {
+    blurRowsRollingSSE(input, inputRow0, w, h, r, blurred, blurRow0, nextBlur, blurEnd, scratch, nextBlur > 0);
+    nextBlur = blurEnd;
+  }
+
+  int const gradEnd = last ? h : std::max(nextGrad, nextBlur - r - 2);
+  if (gradEnd > nextGrad)
+  {
+    kernels->gradient[d][ri](blurred, blurRow0, w, last ? h : nextBlur, r, gradX, gradY, gradRow0, nextGrad, gradEnd);
+    nextGrad = gradEnd;
+  }
+
+  int const ridgeBegin = nextRidge;
+  int const ridgeEnd = last ? h : std::max(nextRidge, nextGrad - r - 2);
+  if (ridgeEnd > nextRidge)
+  {
+    kernels->ridge[d][ri](gradX, gradY, gradRow0, w, last ? h : nextGrad, r, outputRows, nextRidge, nextRidge, ridgeEnd);
+    nextRidge = ridgeEnd;
+  }
+
+  // a push() adds at most streamChunkRows rows to each window, and a finish() at most 2r+2
+  int const headroom = streamChunkRows + 2*r + 2;
+
+  if (h - inputRow0 + headroom > windowRows)
+  {
+    int const newInputRow0 = std::max(inputRow0, nextBlur - r);
+    memmove(input, input + 4*w*(newInputRow0 - inputRow0), sizeof(float) * 4 * w * (h - newInputRow0));
+    inputRow0 = newInputRow0;
+  }
+
+  if (nextBlur - blurRow0 + headroom > windowRows)
+  {
+    int const newBlurRow0 = std::max(blurRow0, nextGrad - r);
+    memmove(blurred, blurred + w*(newBlurRow0 - blurRow0), sizeof(float) * w * (nextBlur - newBlurRow0));
+    blurRow0 = newBlurRow0;
+  }
+
+  if (nextGrad - gradRow0 + headroom > windowRows)
+  {
+    int const newGradRow0 = std::max(gradRow0, nextRidge - r);
+    memmove(gradX, gradX + w*(newGradRow0 - gradRow0), sizeof(float) * w * (nextGrad - newGradRow0));
+    memmove(gradY, gradY + w*(newGradRow0 - gradRow0), sizeof(float) * w * (nextGrad - newGradRow0));
+    gradRow0 = newGradRow0;
+  }
+
+  return ridgeEnd - ridgeBegin;
+}
+
+//! Set the rows within reach of a set row in rows, clamped to the image
+static std::vector<uint8_t> dilateRows(std::vector<uint8_t> const & rows, int const reach)
+{
+  int const h = int(rows.size());
+  std::vector<uint8_t> dilated(h, 0);
+  int last = -reach-1;
+  for (int y = 0; y < h; y++)
+  {
+    if (rows[y])
+      last = y;
+    dilated[y] = y - last <= reach;
+  }
+  last = h + reach;
+  for (int y = h-1; y >= 0; y--)
+  {
+    if (rows[y])
+      last = y;
+    dilated[y] |= last - y <= reach;
+  }
+  return dilated;
+}
+
+VrdVideo::VrdVideo(int const w, int const h, int const r) :
+  w(w), h(h), r(r), tileRows(std::max(16, 4*r)), valid(false), recomputed(1.0f)
+{
+  context.buffer(InputBuffer, sizeof(float) * 4 * w * h);
+  context.buffer(BlurBuffer, sizeof(float) * w * h);
+  context.buffer(GradXBuffer, sizeof(float) * w * h);
+  context.buffer(GradYBuffer, sizeof(float) * w * h);
+  context.buffer(EdgeBuffer, sizeof(float) * w * h);
+}
+
+void VrdVideo::reset()
+{
+  valid = false;
+}
+
+float VrdVideo::recomputedFraction() const
+{
+  return recomputed;
+}
+
+/*! The blur runs the Rolling engine on each tile of tileRows rows, priming its column sums at the top of the tile,
+    so a blurred row only depends on the input rows from r rows above its tile to r rows below itself, and is the
+    same whichever other tiles are recomputed. The gradient and ridge of a row only depend on the rows up to r above
+    and below it in the previous stage. A changed input tile then dirties the blur of the tiles within r rows of it,
+    and the gradients and edge map r and 2r rows beyond those. */
+void VrdVideo::process(float const * const inputImage, float * outputImage)
+{
+  VrdKernels const * const kernels = vrdKernels();
+  int const d = directionIndex(vrdNumDirections);
+  int const ri = vrdSpecializeRadii ? radiusIndex(r) : 0;
+  int const numThreads = std::min(stageThreads(), h);
+  int const numTiles = (h + tileRows - 1) / tileRows;
+
+  float * const previous = static_cast<float *>(context.buffer(InputBuffer, 0));
+  float * const blurred = static_cast<float *>(context.buffer(BlurBuffer, 0));
+  float * const gradX = static_cast<float *>(context.buffer(GradXBuffer, 0));
+  float * const gradY = static_cast<float *>(context.buffer(GradYBuffer, 0));
+  float * const edges = static_cast<float *>(context.buffer(EdgeBuffer, 0));
+
+  // find the tiles whose input changed, and keep their new rows for the next frame
+  std::vector<uint8_t> changed(numTiles);
+  for (int t = 0; t < numTiles; t++)
+  {
+    size_t const offset = size_t(4) * w * t*tileRows;
+    size_t const size = sizeof(float) * 4 * w * (std::min(h, (t+1)*tileRows) - t*tileRows);
+    changed[t] = !valid || memcmp(previous + offset, inputImage + offset, size) != 0;
+    if (changed[t])
+      memcpy(previous + offset, inputImage + offset, size);
+  }
+  valid = true;
+
+  // the mirrored rows at the borders are within r rows of the border as well
+  std::vector<int> blurTiles;
+  int const tileReach = (r + tileRows - 1) / tileRows;
+  for (int t = 0; t < numTiles; t++)
+  {
+    bool dirty = false;
+    for (int u = std::max(0, t - tileReach); u <= std::min(numTiles - 1, t + tileReach); u++)
+      dirty |= changed[u] != 0;
+    if (dirty)
+      blurTiles.push_back(t);
+  }
+
+  bandScratch(context, w, r, numThreads, 0);
+  parallelTiles(numThreads, 0, int(blurTiles.size()), 1, [&](int worker, int k0, int k1)
+  {
+    for (int k = k0; k < k1; k++)
+    {
+      int const y0 = blurTiles[k]*tileRows;
+      blurRowsRollingSSE(previous, 0, w, h, r, blurred, 0, y0, std::min(h, y0 + tileRows),
+          bandScratch(context, w, r, numThreads, worker), false);
+    }
+  });
+
+  std::vector<uint8_t> blurRows(h, 0);
+  for (size_t k = 0; k < blurTiles.size(); k++)
+    std::fill(blurRows.begin() + blurTiles[k]*tileRows, blurRows.begin() + std::min(h, (blurTiles[k]+1)*tileRows), 1);
+
+  std::vector<uint8_t> const gradRows = dilateRows(blurRows, r);
+  forEachRun(gradRows, [&](int const y0, int const y1)
+  {
+    parallelTiles(numThreads, y0, y1, tileRowsFor(y1 - y0, numThreads, 8), [&](int, int b0, int b1)
+    {
+      kernels->gradient[d][ri](blurred, 0, w, h, r, gradX, gradY, 0, b0, b1);
+    });
+  });
+
+  std::vector<uint8_t> const ridgeRows = dilateRows(gradRows, r);
+  int numRecomputed = 0;
+  forEachRun(ridgeRows, [&](int const y0, int const y1)
+  {
+    parallelTiles(numThreads, y0, y1, tileRowsFor(y1 - y0, numThreads, 8), [&](int, int b0, int b1)
+    {
+      kernels->ridge[d][ri](gradX, gradY, 0, w, h, r, edges, 0, b0, b1);
+    });
+    numRecomputed += y1 - y0;
+  });
+  recomputed = float(numRecomputed) / h;
+
+  memcpy(outputImage, edges, sizeof(float) * w * h);
+}
+
+//! A bounded queue that hands items from one VrdPipeline stage to the next
+/*! It holds at most a few frames and is touched a couple of times per frame, so a mutex costs nothing measurable next
+    to the stages, and it gives the waiting side something to sleep on. */
+template<class T>
+class StageQueue
+{
+  public:
+    explicit StageQueue(size_t const capacity) : capacity(capacity), closed(false) { }
+
+    //! Wait until there is room, then append item
+    void push(T item)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      notFull.wait(lock, [&]() { return items.size() < capacity; });
+      items.push_back(std::move(item));
+      notEmpty.notify_one();
+    }
+
+    //! Append item, first moving the oldest item out into dropped if the queue is full
+    /*! \return Whether an item was dropped */
+    bool pushDropOldest(T item, T & dropped)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      bool const full = items.size() >= capacity;
+      if (full)
+      {
+        dropped = std::move(items.front());
+        items.pop_front();
       }
-      gradX[i + j*w] = sumX;
-      gradY[i + j*w] = sumY;
+      items.push_back(std::move(item));
+      notEmpty.notify_one();
+      return full;
+    }
+
+    //! Wait for an item and take it
+    /*! \return false once the queue is closed and empty */
+    bool pop(T & item)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      notEmpty.wait(lock, [&]() { return !items.empty() || closed; });
+      if (items.empty())
+        return false;
+      item = std::move(items.front());
+      items.pop_front();
+      notFull.notify_one();
+      return true;
+    }
+
+    //! Let pop() return false once the queue is drained
+    void close()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+      notEmpty.notify_all();
+    }
+
+  private:
+    size_t const capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+};
+
+//! A frame on its way through a VrdPipeline
+struct PipelineFrame
+{
+  std::function<void(VrdContext &, float *)> blur; //!< Blur the input frame into the given image
+  float * outputImage;
+  float * skippedFraction;                         //!< Where to write the fraction of flat tiles skipped, if set
+  int buffer;                                      //!< The blurred image buffer the frame holds, once blurred
+  std::promise<bool> done;
+};
+
+struct VrdPipeline::Impl
+{
+  Impl(int const w, int const h, int const r, int const queueDepth, Backpressure const backpressure) :
+    w(w), h(h), r(r), backpressure(backpressure), pending(std::max(1, queueDepth)), blurred(2), freeBuffers(2)
+  {
+    for (int b = 0; b < 2; b++)
+    {
+      buffers[b].resize(w*h);
+      freeBuffers.push(b);
     }
+    blurThread = std::thread([this]() { blurStage(); });
+    ridgeThread = std::thread([this]() { ridgeStage(); });
   }
+
+  //! Blur each pending frame into a free buffer and pass it on
+  void blurStage()
+  {
+    PipelineFrame frame;
+    while (pending.pop(frame))
+    {
+      freeBuffers.pop(frame.buffer);
+      frame.blur(blurContext, &buffers[frame.buffer][0]);
+      blurred.push(std::move(frame));
+    }
+    blurred.close();
+  }
+
+  //! Run the gradient and ridge stages on each blurred frame, then give its buffer back to the blur stage
+  void ridgeStage()
+  {
+    PipelineFrame frame;
+    while (blurred.pop(frame))
+    {
+      gradientRidgeSSE(&buffers[frame.buffer][0], frame.outputImage, w, h, r, ridgeContext);
+      if (frame.skippedFraction)
+        *frame.skippedFraction = ridgeContext.flatSkippedFraction();
+      freeBuffers.push(frame.buffer);
+      frame.done.set_value(true);
+    }
+  }
+
+  std::future<bool> submit(std::function<void(VrdContext &, float *)> blur, float * const outputImage,
+      float * const skippedFraction)
+  {
+    PipelineFrame frame;
+    frame.blur = std::move(blur);
+    frame.outputImage = outputImage;
+    frame.skippedFraction = skippedFraction;
+    std::future<bool> result = frame.done.get_future();
+
+    if (backpressure == Backpressure::Block)
+      pending.push(std::move(frame));
+    else
+    {
+      PipelineFrame dropped;
+      if (pending.pushDropOldest(std::move(frame), dropped))
+        dropped.done.set_value(false);
+    }
+    return result;
+  }
+
+  int const w;
+  int const h;
+  int const r;
+  Backpressure const backpressure;
+  StageQueue<PipelineFrame> pending;     //!< Submitted frames waiting for the blur stage
+  StageQueue<PipelineFrame> blurred;     //!< Blurred frames waiting for the gradient and ridge stages
+  StageQueue<int> freeBuffers;           //!< The blurred image buffers that no frame holds
+  std::vector<float> buffers[2];
+  VrdContext blurContext;
+  VrdContext ridgeContext;
+  std::thread blurThread;
+  std::thread ridgeThread;
+};
+
+VrdPipeline::VrdPipeline(int const w, int const h, int const r, int const queueDepth, Backpressure const backpressure) :
+  impl(new Impl(w, h, r, queueDepth, backpressure))
+{ }
+
+VrdPipeline::~VrdPipeline()
+{
+  impl->pending.close();
+  impl->blurThread.join();
+  impl->ridgeThread.join();
+  delete impl;
 }
 
-void calculateRidgeSSE(float const * const gradX, float const * const gradY, int const w, int const h, int const r, float * ridgeImage)
+std::future<bool> VrdPipeline::submit(float const * const inputImage, float * outputImage, float * skippedFraction)
 {
-  float dx[NUM_GRADIENT_DIRECTIONS];
-  float dy[NUM_GRADIENT_DIRECTIONS];
-  float rdx[NUM_GRADIENT_DIRECTIONS];
-  float rdy[NUM_GRADIENT_DIRECTIONS];
+  int const w = impl->w;
+  int const h = impl->h;
+  int const r = impl->r;
+  return impl->submit([=](VrdContext & ctx, float * blurred) { blurredVarianceSSE(inputImage, w, h, r, blurred, &ctx); },
+      outputImage, skippedFraction);
+}
 
-  float const pi2 = 2.0f*M_PI;
-  float const norm = 1.0/float(NUM_GRADIENT_DIRECTIONS);
+std::future<bool> VrdPipeline::submitRGB(uint8_t const * const rgbImage, float * outputImage, float * skippedFraction)
+{
+  int const w = impl->w;
+  int const h = impl->h;
+  int const r = impl->r;
+  return impl->submit([=](VrdContext & ctx, float * blurred) { blurredVarianceRGBSSE(rgbImage, w, h, r, blurred, &ctx); },
+      outputImage, skippedFraction);
+}
+
+//! Compute band-local rows [j0, j1) of the reflect padded integer integral images of a planar uint8 image
+/*! Same layout as paddedIntegralBandSSE(), with uint32 LABX sums. The sums may wrap around, but every box sum is
+    taken modulo 2^32 as well, so box sums that fit in 32 bits (see blurredVarianceSSE()) come out exact. */
+static void paddedIntegralBandU8SSE(uint8_t const * const l, uint8_t const * const a, uint8_t const * const b, size_t const pitch,
+    int const w, int const h, int const r, int const j0, int const j1, uint32_t * const integral, uint32_t * const integral2,
+    char * const scratch)
+{
+  int const stride = 4*(w+2*r);
+  int * const colIndex = reinterpret_cast<int *>(scratch);
 
-  /* pre-load dx and dy */
-  for (int k = 0; k < NUM_GRADIENT_DIRECTIONS; k++)
+  // mirrored source column for each padded column
+  for (int i = 1; i < w+2*r; i++)
+    colIndex[i] = reflect101(i-r, w);
+
+  for (int j = j0; j < j1; j++)
   {
-    float const idx = pi2*float(k)*norm;
-    dx[k] = cos(idx);
-    dy[k] = sin(idx);
+    size_t const row = pitch*reflect101(j-r, h);
+    uint8_t const * const lrowptr = l + row;
+    uint8_t const * const arowptr = a + row;
+    uint8_t const * const browptr = b + row;
+    int const yabove = (j == j0) ? 0 : stride*(j-1);
+    int const yw = stride*j;
+
+    __m128i _sum  = _mm_setzero_si128();
+    __m128i _sum2 = _mm_setzero_si128();
+    _mm_store_si128((__m128i*)&integral[yw], _sum);
+    _mm_store_si128((__m128i*)&integral2[yw], _sum2);
+
+    for (int i = 1; i < w+2*r; i++)
+    {
+      int const c = colIndex[i];
+      __m128i _curr = _mm_set_epi32(0, browptr[c], arowptr[c], lrowptr[c]);
+
+      // each 32 bit lane holds a single 16 bit value, so madd squares it exactly
+      _sum  = _mm_add_epi32(_sum, _curr);
+      _sum2 = _mm_add_epi32(_sum2, _mm_madd_epi16(_curr, _curr));
 
-    rdx[k] = int(r*dx[k]);
-    rdy[k] = int(r*dy[k]);
+      _mm_store_si128((__m128i*)&integral[ yw + 4*i ], _mm_add_epi32(_mm_load_si128((__m128i*)&integral[ yabove + 4*i ]), _sum));
+      _mm_store_si128((__m128i*)&integral2[ yw + 4*i ], _mm_add_epi32(_mm_load_si128((__m128i*)&integral2[ yabove + 4*i ]), _sum2));
+    }
   }
+}
 
-  for (int j = 0; j < h; j++)
+//! Stitch band-local integer integral images together, as integralCarrySSE() does for float ones
+static void integralCarryU8SSE(uint32_t * const integral, uint32_t * const integral2, int const stride, int const h, int const numBands,
+    VrdContext & context)
+{
+  // carry[b] holds the final value of the row just above band b
+  uint32_t * const carry  = static_cast<uint32_t *>(context.buffer(CarryBuffer, sizeof(uint32_t) * stride * numBands));
+  uint32_t * const carry2 = static_cast<uint32_t *>(context.buffer(Carry2Buffer, sizeof(uint32_t) * stride * numBands));
+  for (int b = 1; b < numBands; b++)
   {
-    for (int i = 0; i < w; i++)
+    int const ylast = stride*((h*b)/numBands - 1);
+    for (int x = 0; x < stride; x += 4)
     {
-      float max = -INFINITY;
+      __m128i _last  = _mm_load_si128((__m128i*)&integral[ ylast + x ]);
+      __m128i _last2 = _mm_load_si128((__m128i*)&integral2[ ylast + x ]);
+      if (b > 1)
+      {
+        _last  = _mm_add_epi32(_last, _mm_load_si128((__m128i*)&carry[ stride*(b-1) + x ]));
+        _last2 = _mm_add_epi32(_last2, _mm_load_si128((__m128i*)&carry2[ stride*(b-1) + x ]));
+      }
+      _mm_store_si128((__m128i*)&carry[ stride*b + x ], _last);
+      _mm_store_si128((__m128i*)&carry2[ stride*b + x ], _last2);
+    }
+  }
 
-      for (int k = 0; k < NUM_GRADIENT_DIRECTIONS; k++)
+  parallelBands(numBands, 0, h, [=](int y0, int y1)
+  {
+    if (y0 == 0) return;
+    int b = 1;
+    while ((h*b)/numBands != y0) b++;
+    uint32_t const * const c  = carry + stride*b;
+    uint32_t const * const c2 = carry2 + stride*b;
+    for (int y = y0; y < y1; y++)
+    {
+      for (int x = 0; x < stride; x += 4)
       {
-        int i_p = fmin(float(w-2), abs(i + rdx[k]));
-        int j_p = fmin(float(h-2), abs(j + rdy[k]));
-        int i_m = fmin(float(w-2), abs(i - rdx[k]));
-        int j_m = fmin(float(h-2), abs(j - rdy[k]));
+        __m128i * const p  = (__m128i*)&integral[ stride*y + x ];
+        __m128i * const p2 = (__m128i*)&integral2[ stride*y + x ];
+        _mm_store_si128(p, _mm_add_epi32(_mm_load_si128(p), _mm_load_si128((__m128i const*)&c[x])));
+        _mm_store_si128(p2, _mm_add_epi32(_mm_load_si128(p2), _mm_load_si128((__m128i const*)&c2[x])));
+      }
+    }
+  });
+}
 
-        float rgeo = sqrt(fmax(0.0F, 
-              -(gradX[i_m + j_m*w] * dx[k] +
-                gradY[i_m + j_m*w] * dy[k]) * 
+//! Convert the low two lanes of four uint32 values to double
+static inline __m128d cvtepu32lo_pd(__m128i const _a)
+{
+  // values at or above 2^31 convert as negative, so add 2^32 back to them
+  __m128d const _d = _mm_cvtepi32_pd(_a);
+  return _mm_add_pd(_d, _mm_and_pd(_mm_cmplt_pd(_d, _mm_setzero_pd()), _mm_set1_pd(4294967296.0)));
+}
 
-              (gradX[i_p + j_p*w] * dx[k] +
-               gradY[i_p + j_p*w] * dy[k])));
+//! Compute n^2 times the squared LABX variance of the box with corners at offsets xlef and xlef+span, in two lanes
+/*! The numerator n*sum2 - sum^2 of each channel's variance is exact in double precision. Summing the two lanes gives
+    n^4 times the squared l2 norm of the variance. */
+static inline __m128d boxVariance2U8_pd(uint32_t const * const top, uint32_t const * const bot, uint32_t const * const top2,
+    uint32_t const * const bot2, int const xlef, int const span, __m128d const _n)
+{
+  int const xrig = xlef + span;
 
-        float rarith = fmax(0.0F,
-            (gradX[i_m + j_m*w] * dx[k] + gradY[i_m + j_m*w] * dy[k]) - 
-            (gradX[i_p + j_p*w] * dx[k] + gradY[i_p + j_p*w] * dy[k])
-            );
+  // box sums, exact modulo 2^32
+  __m128i _sum = _mm_sub_epi32(_mm_load_si128((__m128i const*)&bot[xrig]), _mm_load_si128((__m128i const*)&bot[xlef]));
+  _sum = _mm_add_epi32(_mm_sub_epi32(_sum, _mm_load_si128((__m128i const*)&top[xrig])), _mm_load_si128((__m128i const*)&top[xlef]));
+  __m128i _sum2 = _mm_sub_epi32(_mm_load_si128((__m128i const*)&bot2[xrig]), _mm_load_si128((__m128i const*)&bot2[xlef]));
+  _sum2 = _mm_add_epi32(_mm_sub_epi32(_sum2, _mm_load_si128((__m128i const*)&top2[xrig])), _mm_load_si128((__m128i const*)&top2[xlef]));
 
-        max = fmax(max, rgeo+rarith);
-      }
-      ridgeImage[i+j*w] = fabs((max - sqrt(pow(gradX[i + j*w], 2) + pow(gradY[i + j*w], 2)))-128);
+  // the plain sums are below 2^31, only the squared sums need the unsigned conversion
+  __m128d const _slo  = _mm_cvtepi32_pd(_sum);
+  __m128d const _shi  = _mm_cvtepi32_pd(_mm_shuffle_epi32(_sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  __m128d const _s2lo = cvtepu32lo_pd(_sum2);
+  __m128d const _s2hi = cvtepu32lo_pd(_mm_shuffle_epi32(_sum2, _MM_SHUFFLE(1, 0, 3, 2)));
+
+  __m128d const _varlo = _mm_sub_pd(_mm_mul_pd(_n, _s2lo), _mm_mul_pd(_slo, _slo));
+  __m128d const _varhi = _mm_sub_pd(_mm_mul_pd(_n, _s2hi), _mm_mul_pd(_shi, _shi));
+
+  return _mm_add_pd(_mm_mul_pd(_varlo, _varlo), _mm_mul_pd(_varhi, _varhi));
+}
+
+//! Compute the blurred variance for the output rows [yBegin, yEnd) from the padded integer integral images
+/*! The variances are exact up to the point where the channels are combined, so the only rounding is in the l2 norm,
+    the square root and the final normalization. */
+static void blurRowsU8SSE(uint32_t const * const integral, uint32_t const * const integral2, int const w, int const r,
+    float * outputImage, int const yBegin, int const yEnd)
+{
+  int const stride = 4*(w+2*r);
+  int const span = 8*r;
+  double const n = 4.0*r*r;
+  __m128d const _n = _mm_set1_pd(n);
+  __m128d const _norm = _mm_set1_pd(1.0/(n*n));
+
+  for (int y = yBegin; y < yEnd; y++)
+  {
+    uint32_t const * const top  = integral + stride*y;
+    uint32_t const * const bot  = integral + stride*(y+2*r);
+    uint32_t const * const top2 = integral2 + stride*y;
+    uint32_t const * const bot2 = integral2 + stride*(y+2*r);
+    float * const outputrowptr = outputImage + y*w;
+
+    // two pixels at a time, so that the square root and normalization are shared
+    int x = 0;
+    for (; x + 2 <= w; x += 2)
+    {
+      __m128d const _l2norm0 = boxVariance2U8_pd(top, bot, top2, bot2, 4*x,     span, _n);
+      __m128d const _l2norm1 = boxVariance2U8_pd(top, bot, top2, bot2, 4*x + 4, span, _n);
+      __m128d const _l2norm  = _mm_add_pd(_mm_unpacklo_pd(_l2norm0, _l2norm1), _mm_unpackhi_pd(_l2norm0, _l2norm1));
+
+      _mm_storel_pi((__m64*)&outputrowptr[x], _mm_cvtpd_ps(_mm_mul_pd(_mm_sqrt_pd(_l2norm), _norm)));
+    }
+    if (x < w)
+    {
+      __m128d _l2norm = boxVariance2U8_pd(top, bot, top2, bot2, 4*x, span, _n);
+      _l2norm = _mm_add_sd(_l2norm, _mm_unpackhi_pd(_l2norm, _l2norm));
+
+      outputrowptr[x] = float(_mm_cvtsd_f64(_mm_mul_sd(_mm_sqrt_sd(_l2norm, _l2norm), _norm)));
     }
   }
+}
+
+void blurredVarianceSSE(uint8_t const * const l, uint8_t const * const a, uint8_t const * const b, int const w, int const h,
+    size_t const pitch, int const r, float * outputImage, VrdContext * context)
+{
+  VrdContext localContext;
+  VrdContext & ctx = context ? *context : localContext;
+
+  // the squared box sums overflow 32 bits past r = 128, so widen each row to LABX floats there
+  if (r > 128)
+  {
+    blurredVariancePaddedSSE([=](int y, float * rowBuffer)
+    {
+      for (int x = 0; x < w; x++)
+      {
+        rowBuffer[4*x]   = l[pitch*y + x];
+        rowBuffer[4*x+1] = a[pitch*y + x];
+        rowBuffer[4*x+2] = b[pitch*y + x];
+        rowBuffer[4*x+3] = 0.0F;
+      }
+      return (float const *)rowBuffer;
+    }, w, h, r, outputImage, ctx);
+    return;
+  }
+
+  int const numThreads = std::min(stageThreads(), h);
+  int const stride = 4*(w+2*r);
+  int const paddedh = h+2*r;
+  uint32_t * const integral  = static_cast<uint32_t *>(ctx.buffer(IntegralBuffer, sizeof(uint32_t) * stride * paddedh));
+  uint32_t * const integral2 = static_cast<uint32_t *>(ctx.buffer(Integral2Buffer, sizeof(uint32_t) * stride * paddedh));
+
+  // row 0 stays zero, the remaining rows are built in bands and stitched together
+  memset(integral, 0, sizeof(uint32_t) * stride);
+  memset(integral2, 0, sizeof(uint32_t) * stride);
+  int const numBands = std::min(numThreads, paddedh-1);
+  bandScratch(ctx, w, r, numBands, 0);
+  parallelBandsIndexed(numBands, 1, paddedh, [&](int band, int j0, int j1)
+  {
+    paddedIntegralBandU8SSE(l, a, b, pitch, w, h, r, j0, j1, integral, integral2, bandScratch(ctx, w, r, numBands, band));
+  });
+  integralCarryU8SSE(integral + stride, integral2 + stride, stride, paddedh-1, numBands, ctx);
+
+  parallelTiles(numThreads, 0, h, tileRowsFor(h, numThreads, 8), [=](int, int y0, int y1)
+  {
+    blurRowsU8SSE(integral, integral2, w, r, outputImage, y0, y1);
+  });
+}
+
+void blurredVarianceSSE(uint8_t const * const inputImage, int const w, int const h, int const r, float * outputImage, VrdContext * context)
+{
+  blurredVarianceSSE(inputImage, inputImage + w*h, inputImage + 2*w*h, w, h, w, r, outputImage, context);
+}
+
+//! Interleave n pixels of three float planes into LABX, four pixels at a time
+static void interleaveRowSSE(float const * const l, float const * const a, float const * const b, int const n, float * const labx)
+{
+  int x = 0;
+  for (; x + 4 <= n; x += 4)
+  {
+    __m128 _l = _mm_loadu_ps(&l[x]);
+    __m128 _a = _mm_loadu_ps(&a[x]);
+    __m128 _b = _mm_loadu_ps(&b[x]);
+    __m128 _x = _mm_setzero_ps();
+
+    _MM_TRANSPOSE4_PS(_l, _a, _b, _x);
+    _mm_store_ps(&labx[4*x],      _l);
+    _mm_store_ps(&labx[4*x + 4],  _a);
+    _mm_store_ps(&labx[4*x + 8],  _b);
+    _mm_store_ps(&labx[4*x + 12], _x);
+  }
+  for (; x < n; x++)
+  {
+    labx[4*x]   = l[x];
+    labx[4*x+1] = a[x];
+    labx[4*x+2] = b[x];
+    labx[4*x+3] = 0.0F;
+  }
+}
+
+void blurredVarianceSSE(float const * const inputImage, int const w, int const h, size_t const pitch, int const r, float * outputImage,
+    VrdContext * context)
+{
+  VrdContext localContext;
+  blurredVariancePaddedSSE([=](int y, float * rowBuffer)
+  {
+    float const * const row = (float const *)((char const *)inputImage + pitch*y);
+
+    // aligned rows are read in place, anything else is copied into the aligned row buffer
+    if ((reinterpret_cast<uintptr_t>(row) & 15) == 0)
+      return row;
+    memcpy(rowBuffer, row, sizeof(float) * 4 * w);
+    return (float const *)rowBuffer;
+  }, w, h, r, outputImage, context ? *context : localContext);
+}
+
+void blurredVarianceSSE(float const * const l, float const * const a, float const * const b, int const w, int const h,
+    size_t const pitch, int const r, float * outputImage, VrdContext * context)
+{
+  VrdContext localContext;
+  blurredVariancePaddedSSE([=](int y, float * rowBuffer)
+  {
+    size_t const row = pitch*y;
+    interleaveRowSSE((float const *)((char const *)l + row), (float const *)((char const *)a + row),
+        (float const *)((char const *)b + row), w, rowBuffer);
+    return (float const *)rowBuffer;
+  }, w, h, r, outputImage, context ? *context : localContext);
+}
+
+void calculateGradientSSE(float const * const inputImage, int const w, int const h, int const r, float * gradX, float * gradY)
+{
+  VrdKernels const * const kernels = vrdKernels();
+  int const d = directionIndex(vrdNumDirections);
+  int const ri = vrdSpecializeRadii ? radiusIndex(r) : 0;
+  int const numThreads = std::min(stageThreads(), h);
+
+  parallelTiles(numThreads, 0, h, tileRowsFor(h, numThreads, 8), [=](int, int y0, int y1)
+  {
+    kernels->gradient[d][ri](inputImage, 0, w, h, r, gradX, gradY, 0, y0, y1);
+  });
+}
+
+void calculateRidgeSSE(float const * const gradX, float const * const gradY, int const w, int const h, int const r, float * ridgeImage)
+{
+  VrdKernels const * const kernels = vrdKernels();
+  int const d = directionIndex(vrdNumDirections);
+  int const ri = vrdSpecializeRadii ? radiusIndex(r) : 0;
+  int const numThreads = std::min(stageThreads(), h);
+
+  parallelTiles(numThreads, 0, h, tileRowsFor(h, numThreads, 8), [=](int, int y0, int y1)
+  {
+    kernels->ridge[d][ri](gradX, gradY, 0, w, h, r, ridgeImage, 0, y0, y1);
+  });
+}
+
+void nonMaxSuppressionSSE(float const * const ridgeImage, int const w, int const h, float * outputImage, float * directionMaps)
+{
+  VrdKernels const * const kernels = vrdKernels();
+  int const d = directionIndex(vrdNumDirections);
+  int const numThreads = std::min(stageThreads(), h);
+
+  parallelTiles(numThreads, 0, h, tileRowsFor(h, numThreads, 8), [=](int, int y0, int y1)
+  {
+    kernels->nms[d](ridgeImage, w, h, outputImage, directionMaps, y0, y1);
+  });
+}
+
+//! The root of pixel i's set, halving the path on the way when compress is set
+static inline int32_t findRoot(int32_t * const parent, int32_t i, bool const compress)
+{
+  while (parent[i] != i)
+  {
+    if (compress)
+      parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+//! Merge the sets of pixels a and b under the smaller of their roots, carrying over the strong flag
+static inline void uniteRoots(int32_t * const parent, uint8_t * const strong, int32_t const a, int32_t const b)
+{
+  int32_t const ra = findRoot(parent, a, true);
+  int32_t const rb = findRoot(parent, b, true);
+  if (ra == rb)
+    return;
+
+  int32_t const lo = std::min(ra, rb);
+  int32_t const hi = std::max(ra, rb);
+  parent[hi] = lo;
+  strong[lo] |= strong[hi];
+}
+
+int hysteresisSSE(float const * const edgeImage, int const w, int const h, float const lowThreshold, float const highThreshold,
+    uint8_t * edgeMap, int32_t * labels, VrdContext * context)
+{
+  VrdContext localContext;
+  VrdContext & ctx = context ? *context : localContext;
+  int const numThreads = std::min(stageThreads(), h);
+  int const tileRows = tileRowsFor(h, numThreads, 8);
+
+  int32_t * const parent = static_cast<int32_t *>(ctx.buffer(UnionFindBuffer, (sizeof(int32_t) + 1) * w * h));
+  uint8_t * const strong = reinterpret_cast<uint8_t *>(parent + w*h);
+
+  // link the candidates of each tile with their 8-connected neighbours in the same tile. Every set keeps its smallest
+  // pixel index as its root, so the final labels do not depend on how the rows were tiled.
+  parallelTiles(numThreads, 0, h, tileRows, [=](int, int y0, int y1)
+  {
+    for (int y = y0; y < y1; y++)
+      for (int x = 0; x < w; x++)
+      {
+        int32_t const i = x + y*w;
+        parent[i] = i;
+        strong[i] = edgeImage[i] >= highThreshold;
+        if (!(edgeImage[i] >= lowThreshold))
+          continue;
+
+        // the neighbour above touches the other three, so when it is a candidate they are already in its set
+        bool const up      = y > y0 && edgeImage[i-w] >= lowThreshold;
+        bool const left    = x > 0 && edgeImage[i-1] >= lowThreshold;
+        bool const upLeft  = y > y0 && x > 0 && edgeImage[i-w-1] >= lowThreshold;
+        bool const upRight = y > y0 && x < w-1 && edgeImage[i-w+1] >= lowThreshold;
+
+        if (up)
+          uniteRoots(parent, strong, i, i-w);
+        else
+        {
+          if (left)
+            uniteRoots(parent, strong, i, i-1);
+          else if (upLeft)
+            uniteRoots(parent, strong, i, i-w-1);
+          if (upRight)
+            uniteRoots(parent, strong, i, i-w+1);
+        }
+      }
+
+    // point every pixel straight at its root. Parents never have a larger index, so one pass in raster order does it.
+    for (int32_t i = y0*w; i < y1*w; i++)
+      parent[i] = parent[parent[i]];
+  });
+
+  // stitch each tile to the one above it along their shared edge
+  for (int y = tileRows; y < h; y += tileRows)
+    for (int x = 0; x < w; x++)
+    {
+      int32_t const i = x + y*w;
+      if (!(edgeImage[i] >= lowThreshold))
+        continue;
+      for (int dx = -1; dx <= 1; dx++)
+        if (x+dx >= 0 && x+dx < w && edgeImage[i-w+dx] >= lowThreshold)
+          uniteRoots(parent, strong, i, i-w+dx);
+    }
+
+  // keep the candidates whose set holds a strong pixel. The parents are only read from here on.
+  std::vector<int> chains(numThreads, 0);
+  int * const chainCounts = &chains[0];
+  parallelTiles(numThreads, 0, h, tileRows, [=](int t, int y0, int y1)
+  {
+    // the flattening above leaves at most the chain of tile roots that the stitching joined to walk, and the
+    // random edge pixels are masked in rather than branched on
+    int count = 0;
+    for (int32_t i = y0*w; i < y1*w; i++)
+    {
+      int32_t const root = findRoot(parent, parent[i], false);
+      int32_t const edge = (edgeImage[i] >= lowThreshold) & strong[root];
+      count += edge & (root == i);
+
+      if (edgeMap)
+        edgeMap[i] = uint8_t(-edge);
+      if (labels)
+        labels[i] = (root + 1) & -edge;
+    }
+    chainCounts[t] += count;
+  });
 
+  int numChains = 0;
+  for (int t = 0; t < numThreads; t++)
+    numChains += chains[t];
+  return numChains;
 }
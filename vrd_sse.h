@@ -1,15 +1,91 @@
+#include <stddef.h>
 #include <stdint.h>
+#include <future>
+
+//! The box filter implementations available to blurredVarianceSSE()
+enum class BlurEngine
+{
+  //! Build two full w*h LABX integral images (32 bytes of scratch per pixel) and look the boxes up in them
+  IntegralImage,
+
+  //! Keep rolling column sums of the 2r rows in the window and slide a 2r wide sum across them
+  /*! Scratch memory is two rows of LABX sums per thread, independent of the image height. Borders are mirrored, so
+   *  every output pixel is normalized by the full 2r*2r box. The interior matches IntegralImage up to float rounding,
+   *  and the rolling sums are typically much closer to a double precision reference than the integral images. */
+  Rolling,
+
+  //! Build the integral images over the image padded by r mirrored pixels on every side
+  /*! Every box is then a full 2r*2r box, so a single branch-free kernel covers the whole image instead of the
+   *  IntegralImage engine's separate corner, edge and interior loops. Borders match the Rolling engine. Scratch is
+   *  two (w+2r)*(h+2r) LABX integral images. */
+  PaddedIntegral
+};
+
+//! The instruction sets that the VRD kernels are compiled for, from narrowest to widest
+enum class IsaLevel
+{
+  SSE,    //!< 128 bit kernels, available everywhere
+  AVX2,   //!< 256 bit kernels
+  AVX512  //!< 512 bit kernels, needs AVX-512F
+};
+
+//! Scratch memory for the VRD stages, kept between calls so that steady state processing does no allocation
+/*! Every blurredVarianceSSE() and vrd_sse() overload, and hysteresisSSE(), takes an optional context. Without one, each call allocates and
+ *  frees its own scratch (two integral images, plus a window of gradient rows in vrd_sse()). With one, the scratch buffers are
+ *  taken from the context, which grows them on demand and keeps them until it is destroyed. Buffers are 64 byte
+ *  aligned.
+ *
+ *  A context may only be used by one call at a time, so keep one per thread. The stages still start their worker
+ *  threads on every call when setNumThreadsSSE() is above 1. */
+class VrdContext
+{
+  public:
+    //! Create a context, reserving scratch for images up to maxW*maxH with radii up to maxR if they are given
+    VrdContext(int const maxW = 0, int const maxH = 0, int const maxR = 0);
+
+    //! Free the scratch buffers
+    ~VrdContext();
+
+    //! Grow the scratch buffers to fit any blur engine on a w*h image with radius r and the current thread count
+    void reserve(int const w, int const h, int const r);
+
+    //! Get scratch buffer index, grown to at least size bytes (used by the VRD stages)
+    void * buffer(int const index, size_t const size);
+
+    //! The total size of the scratch buffers in bytes
+    size_t size() const;
+
+    //! The fraction of tiles whose gradient and ridge stages the last edge map computed with this context skipped
+    /*! See setFlatSkipSSE(). This is 0 when flat tiles are not skipped. */
+    float flatSkippedFraction() const;
+
+    //! Record the fraction of flat tiles skipped (used by the VRD stages)
+    void setFlatSkippedFraction(float const fraction);
+
+  private:
+    VrdContext(VrdContext const &) = delete;
+    VrdContext & operator=(VrdContext const &) = delete;
+
+    static int const numBuffers = 12;
+    void * buffers[numBuffers];
+    size_t sizes[numBuffers];
+    float flatSkipped;
+};
 
 //! Run the Variance Ridge Detector on an input image
 /*! This method simply chains together blurredVarianceSSE(), calculateGradientSSE(), and calculateRidgeSSE(), and is really the only
  *  method that users should need.
  *
+ *  The gradient and ridge stages run fused, a band of rows at a time, so the gradients never exist as full frames.
+ *  The overloads that return the gradients run the two stages one after the other instead, and give the same edge map.
+ *
  *  \param[in] inputImage a w*h*4 float array containing the LABX image
  *  \param[in] w The width of the input image
  *  \param[in] h The height of the input image
  *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
- *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written */
-void vrd_sse(float const * const inputImage, int const w, int const h, int const r, float * outputImage);
+ *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_sse(float const * const inputImage, int const w, int const h, int const r, float * outputImage, VrdContext * context = nullptr);
 
 //! Run the Variance Ridge Detector on an input image, and get the magnitude, x, and y gradients
 /*! This method simply chains together blurredVarianceSSE(), calculateGradientSSE(), and calculateRidgeSSE(), and is really the only
@@ -21,16 +97,351 @@ void vrd_sse(float const * const inputImage, int const w, int const h, int const
  *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
  *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written 
  *  \param[out] vGradient a pointer to an allocated w*h chunk of floats where the output vertical gradient will be written (horizontal edges)
- *  \param[out] hGradient a pointer to an allocated w*h chunk of floats where the output horizontal gradient will be written (vertical edges) */
-void vrd_sse(float const * const inputImage, int const w, int const h, int const r, float * outputImage, float * vGradient, float * hGradient);
+ *  \param[out] hGradient a pointer to an allocated w*h chunk of floats where the output horizontal gradient will be written (vertical edges)
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_sse(float const * const inputImage, int const w, int const h, int const r, float * outputImage, float * vGradient, float * hGradient, VrdContext * context = nullptr);
+
+//! Run the Variance Ridge Detector on a planar uint8 LAB image
+/*! Same as vrd_sse(), but the blur reads the bytes directly (see blurredVarianceSSE(uint8_t const * const, int const,
+ *  int const, int const, float *)), so no LABX float copy of the image is needed.
+ *
+ *  \param[in] inputImage a w*h*3 uint8 array containing the L, a and b planes one after the other
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
+ *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_sse(uint8_t const * const inputImage, int const w, int const h, int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Run the Variance Ridge Detector on a planar uint8 LAB image, and get the magnitude, x, and y gradients
+/*! \param[in] inputImage a w*h*3 uint8 array containing the L, a and b planes one after the other
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
+ *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written
+ *  \param[out] vGradient a pointer to an allocated w*h chunk of floats where the output vertical gradient will be written (horizontal edges)
+ *  \param[out] hGradient a pointer to an allocated w*h chunk of floats where the output horizontal gradient will be written (vertical edges)
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_sse(uint8_t const * const inputImage, int const w, int const h, int const r, float * outputImage, float * vGradient, float * hGradient, VrdContext * context = nullptr);
+
+//! Run the Variance Ridge Detector on a LABX image with an arbitrary row pitch and alignment
+/*! \param[in] inputImage Row 0 of an interleaved LABX float image, which does not need to be aligned
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] pitch The distance in bytes from the start of one row to the start of the next, at least 16*w
+ *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
+ *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_sse(float const * const inputImage, int const w, int const h, size_t const pitch, int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Run the Variance Ridge Detector on separate L, a and b float planes
+/*! \param[in] l, a, b Row 0 of each channel plane, which do not need to be aligned
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] pitch The distance in bytes from the start of one row to the start of the next, the same for all three planes
+ *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
+ *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_sse(float const * const l, float const * const a, float const * const b, int const w, int const h, size_t const pitch,
+    int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Run the Variance Ridge Detector on separate L, a and b uint8 planes
+/*! \param[in] l, a, b Row 0 of each channel plane
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] pitch The distance in bytes from the start of one row to the start of the next, the same for all three planes
+ *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
+ *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_sse(uint8_t const * const l, uint8_t const * const a, uint8_t const * const b, int const w, int const h, size_t const pitch,
+    int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Run the Variance Ridge Detector on separate L, a and b uint8 planes, and get the magnitude, x, and y gradients
+/*! \param[in] l, a, b Row 0 of each channel plane
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] pitch The distance in bytes from the start of one row to the start of the next, the same for all three planes
+ *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
+ *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written
+ *  \param[out] vGradient a pointer to an allocated w*h chunk of floats where the output vertical gradient will be written (horizontal edges)
+ *  \param[out] hGradient a pointer to an allocated w*h chunk of floats where the output horizontal gradient will be written (vertical edges)
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_sse(uint8_t const * const l, uint8_t const * const a, uint8_t const * const b, int const w, int const h, size_t const pitch,
+    int const r, float * outputImage, float * vGradient, float * hGradient, VrdContext * context = nullptr);
+
+//! Run the Variance Ridge Detector at several radii on one image
+/*! Only the box lookups of the blur depend on the radius, so the integral images are built once and every radius is
+ *  evaluated from them, each output matching vrd_sse() at its radius bit for bit. This needs the IntegralImage engine:
+ *  the PaddedIntegral images are padded by r, and the Rolling engine keeps no integral images, so with those two
+ *  engines vrd_sse() simply runs once per radius.
+ *
+ *  \param[in] inputImage a w*h*4 array containing the LABX image
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] radii The n radii to run the detector at
+ *  \param[in] n The number of radii
+ *  \param[out] outputs n pointers to allocated w*h chunks of floats, one edge map per radius. May be nullptr when only
+ *               maxOutput is wanted.
+ *  \param[out] maxOutput Optional. A pointer to an allocated w*h chunk of floats for the largest response over all radii
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_sse_multi(float const * const inputImage, int const w, int const h, int const * const radii, int const n,
+    float * const * outputs, float * maxOutput = nullptr, VrdContext * context = nullptr);
+
+//! Run the Variance Ridge Detector on a batch of images of the same or mixed sizes
+/*! The scratch memory is allocated once for the whole batch instead of once per image. With more than one thread
+ *  (see setNumThreadsSSE()), images of up to about a megapixel are too small to split into tiles efficiently, so they
+ *  are instead handed out whole, one image per thread at a time, largest first. Each of these edge maps is the same
+ *  as vrd_sse() on a single thread. Larger images run one after another on all of the threads, as in vrd_sse().
+ *
+ *  \param[in] inputImages n pointers to the w*h*4 float LABX images
+ *  \param[in] widths The n image widths
+ *  \param[in] heights The n image heights
+ *  \param[in] n The number of images
+ *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
+ *  \param[out] outputImages n pointers to allocated w*h chunks of floats, where the edge maps will be written
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext). It serves the calling thread,
+ *               and the other threads of a batch allocate their own scratch.
+ *  \param[out] skippedFractions Optional array of n floats, where the fraction of flat tiles skipped in each image
+ *               is written (see setFlatSkipSSE()) */
+void vrd_sse_batch(float const * const * inputImages, int const * widths, int const * heights, int const n, int const r,
+    float * const * outputImages, VrdContext * context = nullptr, float * skippedFractions = nullptr);
+
+//! Run the Variance Ridge Detector on an image that arrives a few rows at a time, such as the output of a line sensor
+/*! Each edge map row depends on the LABX rows up to latency() rows below it: r for the blur and r+2 each for the
+ *  gradient and the ridge. push() takes the next input rows and returns the edge map rows whose input has all
+ *  arrived, and finish() marks the end of the frame and returns the rows left over at its bottom border. The stream
+ *  then starts on the next frame. The height of the frame never needs to be known up front.
+ *
+ *  Only a window of rows of each stage is kept, about twice latency() plus a few dozen rows of input, blurred image
+ *  and gradients, so the memory needed does not grow with the frame height. The blur always uses the Rolling engine,
+ *  and the edge map is the same bit for bit as vrd_sse() with BlurEngine::Rolling on a single thread, however the
+ *  rows are pushed.
+ *  The stream itself runs on the calling thread, and may only be used by one thread at a time. */
+class VrdStream
+{
+  public:
+    //! Create a stream for frames w pixels wide, with ridge detector radius r
+    VrdStream(int const w, int const r);
+
+    //! Feed the next n input rows of the frame
+    /*! \param[in] inputRows A n*w*4 float array containing the next LABX rows
+     *  \param[in] n The number of rows
+     *  \param[out] outputRows A pointer to an allocated n*w chunk of floats, where the edge map rows that became
+     *               available are written in order
+     *  \return The number of edge map rows written, which may be anywhere from 0 to n */
+    int push(float const * const inputRows, int const n, float * outputRows);
+
+    //! End the frame and start the next one
+    /*! \param[out] outputRows A pointer to an allocated latency()*w chunk of floats for the remaining edge map rows
+     *  \return The number of edge map rows written */
+    int finish(float * outputRows);
+
+    //! The number of input rows that an edge map row waits for after its own, and the most finish() returns
+    int latency() const;
+
+  private:
+    VrdStream(VrdStream const &) = delete;
+    VrdStream & operator=(VrdStream const &) = delete;
+
+    //! Run every stage as far as the input allows, or to the bottom of a frame of height h once it is complete
+    int process(int const h, bool const last, float * outputRows);
+
+    int w;
+    int r;
+    int windowRows; //!< The rows each stage window has room for
+    int rowsIn;     //!< The number of input rows pushed so far in this frame
+    int inputRow0;  //!< The first frame row in the input window
+    int blurRow0;   //!< The first frame row in the blurred window
+    int gradRow0;   //!< The first frame row in the gradient windows
+    int nextBlur;   //!< The next row to blur
+    int nextGrad;   //!< The next row of gradients to compute
+    int nextRidge;  //!< The next edge map row to return
+    VrdContext context;
+};
+
+//! Run the Variance Ridge Detector on the frames of a mostly static video, recomputing only what changed
+/*! Each frame is compared with the previous one in tiles of rows, and only the rows that a changed tile reaches
+ *  through the blur, gradient and ridge halos are recomputed; the rest of the edge map is kept from earlier frames.
+ *  The blur runs the Rolling engine from the top of each tile, so that a tile comes out the same whether or not its
+ *  neighbours are recomputed. Every edge map is then the same bit for bit as that of the first frame after reset().
+ *  Like the Rolling engine on several threads, the blur matches that of vrd_sse() up to float rounding.
+ *
+ *  The tiles span whole rows, since the stages work a row at a time. The video keeps the previous frame, the blurred
+ *  image, both gradients and the edge map, 36 bytes per pixel. Call reset() after changing any of the settings. */
+class VrdVideo
+{
+  public:
+    //! Create a video of w*h frames with ridge detector radius r
+    VrdVideo(int const w, int const h, int const r);
+
+    //! Run the detector on the next frame
+    /*! \param[in] inputImage a w*h*4 float array containing the LABX image
+     *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written */
+    void process(float const * const inputImage, float * outputImage);
+
+    //! Recompute the whole of the next frame
+    void reset();
+
+    //! The fraction of edge map rows that the last process() recomputed
+    float recomputedFraction() const;
+
+  private:
+    VrdVideo(VrdVideo const &) = delete;
+    VrdVideo & operator=(VrdVideo const &) = delete;
+
+    int w;
+    int h;
+    int r;
+    int tileRows;     //!< The rows per tile, for both the comparison and the blur
+    bool valid;       //!< Whether the context holds the previous frame and its stages
+    float recomputed;
+    VrdContext context;
+};
+
+//! What VrdPipeline::submit() does when the queue of frames waiting for the pipeline is full
+enum class Backpressure
+{
+  Block,     //!< Wait until the pipeline takes the oldest waiting frame
+  DropOldest //!< Drop the oldest waiting frame, whose future then returns false, and queue the new frame in its place
+};
+
+//! Run the Variance Ridge Detector on a sequence of frames, with the stages of consecutive frames overlapping
+/*! submit() queues a frame and returns at once with a future for its edge map. Two threads then run the frames
+ *  through the pipeline: one runs the blur, including the RGB to LAB conversion for submitRGB() frames, and the other
+ *  the gradient and ridge stages. The blurred images go from one to the other through two buffers, so frame N+1 is
+ *  blurred while frame N is in the ridge stage. Each stage still uses setNumThreadsSSE() threads of its own.
+ *
+ *  Every edge map is the same bit for bit as vrd_sse() or vrd_rgb_sse() on the same frame. The settings must not be
+ *  changed while frames are in flight. submit() and submitRGB() may be called from any thread. */
+class VrdPipeline
+{
+  public:
+    //! Start the pipeline threads for w*h frames with ridge detector radius r
+    /*! \param[in] queueDepth The number of submitted frames that may wait for the blur stage
+     *  \param[in] backpressure What submit() does when queueDepth frames are already waiting */
+    VrdPipeline(int const w, int const h, int const r, int const queueDepth = 2,
+        Backpressure const backpressure = Backpressure::Block);
+
+    //! Finish every submitted frame, then stop the pipeline threads
+    ~VrdPipeline();
+
+    //! Queue a frame
+    /*! \param[in] inputImage a w*h*4 float array containing the LABX image, which must stay valid and unchanged until
+     *               the future is ready
+     *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written
+     *  \param[out] skippedFraction Optional pointer to a float where the fraction of flat tiles skipped in this frame
+     *               is written (see setFlatSkipSSE()), before the future becomes true
+     *  \return A future that becomes true once the edge map is written, or false if the frame was dropped */
+    std::future<bool> submit(float const * const inputImage, float * outputImage, float * skippedFraction = nullptr);
+
+    //! Queue an interleaved RGB frame, which is converted to LAB inside the blur stage (see vrd_rgb_sse())
+    std::future<bool> submitRGB(uint8_t const * const rgbImage, float * outputImage, float * skippedFraction = nullptr);
+
+  private:
+    VrdPipeline(VrdPipeline const &) = delete;
+    VrdPipeline & operator=(VrdPipeline const &) = delete;
+
+    struct Impl;
+    Impl * impl;
+};
+
+//! Run the Variance Ridge Detector on an interleaved RGB image
+/*! Same as vrd_sse(), but converts the RGB image to LAB inside the blur (see blurredVarianceRGBSSE()), so the caller
+ *  does not need to build a LABX image first.
+ *
+ *  \param[in] rgbImage a w*h*3 array containing the interleaved RGB image
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] r The desired radius of the ridge detector (a smaller radius will detect finer edges). A good default is 3.
+ *  \param[out] outputImage a pointer to an allocated w*h chunk of floats where the output edge map will be written
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void vrd_rgb_sse(uint8_t const * const rgbImage, int const w, int const h, int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Run the Variance Ridge Detector on an interleaved RGB image with float channels in the 0-255 range
+void vrd_rgb_sse(float const * const rgbImage, int const w, int const h, int const r, float * outputImage, VrdContext * context = nullptr);
 
 //! Calculate the blurred variance on an input image (Step 1 of VRD)
-/*! \param[in] inputImage A w*h*4 float array containing the LABX image
+/*! The algorithm used is chosen with setBlurEngineSSE().
+ *
+ *  \param[in] inputImage A w*h*4 float array containing the LABX image
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] r The desired blur radius
+ *  \param[out] outputImage A pointer to an allocated w*h chunk of floats to be used as the output image
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void blurredVarianceSSE(float const * const inputImage, int const w, int const h, int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Calculate the blurred variance on a planar uint8 LAB image (Step 1 of VRD)
+/*! The integral images are built from the bytes with integer SIMD as uint32 sums, so the box sums are exact and the
+ *  variances are only rounded once when they are normalized. This is independent of the image size, unlike the float
+ *  engines. Borders are mirrored as in BlurEngine::PaddedIntegral, which is used regardless of setBlurEngineSSE().
+ *  Radii above 128, where the squared box sums no longer fit in 32 bits, are computed by the float path instead.
+ *
+ *  \param[in] inputImage A w*h*3 uint8 array containing the L, a and b planes one after the other
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] r The desired blur radius
+ *  \param[out] outputImage A pointer to an allocated w*h chunk of floats to be used as the output image
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void blurredVarianceSSE(uint8_t const * const inputImage, int const w, int const h, int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Calculate the blurred variance on separate L, a and b uint8 planes (Step 1 of VRD)
+/*! Same as the contiguous planar version above, for planes with any row pitch, such as column-major MATLAB planes or
+ *  a sub-image of a larger frame.
+ *
+ *  \param[in] l, a, b Row 0 of each channel plane
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] pitch The distance in bytes from the start of one row to the start of the next, the same for all three planes
+ *  \param[in] r The desired blur radius
+ *  \param[out] outputImage A pointer to an allocated w*h chunk of floats to be used as the output image
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void blurredVarianceSSE(uint8_t const * const l, uint8_t const * const a, uint8_t const * const b, int const w, int const h,
+    size_t const pitch, int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Calculate the blurred variance on a LABX image with an arbitrary row pitch and alignment (Step 1 of VRD)
+/*! Rows are fed to the BlurEngine::PaddedIntegral build one at a time, so the image is never repacked as a whole.
+ *  Rows that start on a 16 byte boundary are read in place and the others are copied into a one row buffer. The
+ *  PaddedIntegral engine is used regardless of setBlurEngineSSE().
+ *
+ *  \param[in] inputImage Row 0 of an interleaved LABX float image, which does not need to be aligned
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] pitch The distance in bytes from the start of one row to the start of the next, at least 16*w
+ *  \param[in] r The desired blur radius
+ *  \param[out] outputImage A pointer to an allocated w*h chunk of floats to be used as the output image
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void blurredVarianceSSE(float const * const inputImage, int const w, int const h, size_t const pitch, int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Calculate the blurred variance on separate L, a and b float planes (Step 1 of VRD)
+/*! Each row of the three planes is interleaved into a one row LABX buffer as the BlurEngine::PaddedIntegral integral
+ *  images are built. The PaddedIntegral engine is used regardless of setBlurEngineSSE().
+ *
+ *  \param[in] l, a, b Row 0 of each channel plane, which do not need to be aligned
  *  \param[in] w The width of the input image
  *  \param[in] h The height of the input image
+ *  \param[in] pitch The distance in bytes from the start of one row to the start of the next, the same for all three planes
  *  \param[in] r The desired blur radius
- *  \param[out] outputImage A pointer to an allocated w*h chunk of floats to be used as the output image */
-void blurredVarianceSSE(float const * const inputImage, int const w, int const h, int const r, float * outputImage);
+ *  \param[out] outputImage A pointer to an allocated w*h chunk of floats to be used as the output image
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void blurredVarianceSSE(float const * const l, float const * const a, float const * const b, int const w, int const h,
+    size_t const pitch, int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Calculate the blurred variance on an interleaved RGB image (Step 1 of VRD)
+/*! Each row is converted to LABX as it is accumulated into the integral images, so no LABX copy of the frame is
+ *  written or read back. The conversion follows PixLABX::fromRGB() in single precision, with a vectorized cube root
+ *  in place of pow(), and agrees with it to about 1e-4. The box filter is always the BlurEngine::PaddedIntegral one.
+ *
+ *  \param[in] rgbImage A w*h*3 array containing the interleaved RGB image
+ *  \param[in] w The width of the input image
+ *  \param[in] h The height of the input image
+ *  \param[in] r The desired blur radius
+ *  \param[out] outputImage A pointer to an allocated w*h chunk of floats to be used as the output image
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext) */
+void blurredVarianceRGBSSE(uint8_t const * const rgbImage, int const w, int const h, int const r, float * outputImage, VrdContext * context = nullptr);
+
+//! Calculate the blurred variance on an interleaved RGB image with float channels in the 0-255 range (Step 1 of VRD)
+void blurredVarianceRGBSSE(float const * const rgbImage, int const w, int const h, int const r, float * outputImage, VrdContext * context = nullptr);
 
 //! Calculate the gradient on an input image (Step 2 of VRD)
 /*! \param[in] inputImage a w*h float array containing a grayscale image
@@ -50,4 +461,120 @@ void calculateGradientSSE(float const * const inputImage, int const w, int const
  *  \param[out] ridgeImage A pointer to an allocated w*h chunk of floats to be used as the ridge output */
 void calculateRidgeSSE(float const * const gradX, float const * const gradY, int const w, int const h, int const r, float * ridgeImage);
 
+//! Thin the ridge output to the pixels that are a local maximum across some ridge direction (Step 4 of VRD)
+/*! There are getNumDirectionsSSE()/2 ridge directions. Along each one, the ridge values are averaged over a line of
+ *  2*getNumDirectionsSSE()+1 points through the pixel and over two parallel lines one pixel to either side of it. A
+ *  pixel keeps its value if it is positive and the center mean is above both side means for at least one direction,
+ *  and is set to 0 otherwise. Near the borders only the points inside the image are averaged.
+ *
+ *  \param[in] ridgeImage A w*h float array containing the ridge output of calculateRidgeSSE() or vrd_sse()
+ *  \param[in] w The width of the images
+ *  \param[in] h The height of the images
+ *  \param[out] outputImage A pointer to an allocated w*h chunk of floats for the suppressed ridge, which must not
+ *               overlap ridgeImage
+ *  \param[out] directionMaps Optional. A pointer to an allocated getNumDirectionsSSE()/2 planes of w*h floats. Plane k
+ *               gets 2*center - left - right for the pixels that are a maximum along ridge direction k, and 0 elsewhere */
+void nonMaxSuppressionSSE(float const * const ridgeImage, int const w, int const h, float * outputImage, float * directionMaps = nullptr);
+
+//! Threshold an edge map with hysteresis and link the surviving pixels into chains (Step 5 of VRD)
+/*! Pixels at or above lowThreshold are edge candidates, and those at or above highThreshold are strong. A candidate
+ *  is kept if it is 8-connected to a strong pixel through other candidates. The connected sets are found with a
+ *  union-find pass over tiles of rows in parallel, followed by a pass that joins the tiles along their shared rows.
+ *
+ *  \param[in] edgeImage A w*h float array, typically the output of nonMaxSuppressionSSE()
+ *  \param[in] w The width of the images
+ *  \param[in] h The height of the images
+ *  \param[in] lowThreshold The smallest value a pixel of a chain may have
+ *  \param[in] highThreshold The value at least one pixel of each chain must reach
+ *  \param[out] edgeMap Optional. A pointer to an allocated w*h chunk of bytes, set to 255 for kept pixels and 0 elsewhere
+ *  \param[out] labels Optional. A pointer to an allocated w*h chunk of ints, set to 0 for pixels that are not kept and
+ *               otherwise to a label shared by every pixel of a chain: 1 plus the raster index of its first pixel
+ *  \param[in] context Optional scratch memory to reuse between calls (see VrdContext)
+ *  \return The number of chains */
+int hysteresisSSE(float const * const edgeImage, int const w, int const h, float const lowThreshold, float const highThreshold,
+    uint8_t * edgeMap, int32_t * labels = nullptr, VrdContext * context = nullptr);
+
+//! Set the number of threads used by the VRD stages
+/*! The blur splits both the integral image construction and the box filter into one row band per thread. With more
+ *  than one thread the integral images are built band by band and stitched together with a carry pass, which rounds
+ *  differently from the serial scan. The two results therefore differ by the float rounding error of the integral
+ *  images, which grows with the image area (a few percent of the output on 640x480 noise). Measured against a double
+ *  precision reference the banded scan is the more accurate of the two, since each band accumulates smaller sums.
+ *  A single thread reproduces the serial output bit for bit.
+ *
+ *  The box filter, gradient and ridge passes are cut into tiles of rows, which the threads take from a shared queue
+ *  as they finish their previous tile, so threads that draw the slower border tiles do not hold up the rest. Each vrd_sse()
+ *  tile recomputes the r rows of gradients it shares with its neighbours, and the output of these passes does not
+ *  depend on the thread count.
+ *
+ *  \param[in] numThreads The number of threads to use, or 0 to use one thread per hardware core. The default is 1. */
+void setNumThreadsSSE(int const numThreads);
+
+//! Get the number of threads used by the VRD stages
+int getNumThreadsSSE();
+
+//! Select the box filter implementation used by blurredVarianceSSE() (and so by vrd_sse())
+/*! \param[in] engine The blur engine to use. The default is BlurEngine::IntegralImage. */
+void setBlurEngineSSE(BlurEngine const engine);
+
+//! Get the box filter implementation used by blurredVarianceSSE()
+BlurEngine getBlurEngineSSE();
+
+//! Select the instruction set used by the VRD kernels
+/*! At startup the widest level supported by the CPU (checked through CPUID) is selected. Setting the VRD_ISA
+ *  environment variable to sse, avx2 or avx512 lowers the startup level, which is useful for A/B testing without
+ *  touching the caller. The wider kernels cover the blur output, the gradient and the ridge, and give bit for bit the
+ *  same results as the SSE ones.
+ *
+ *  \param[in] level The instruction set to use. Levels the CPU does not support fall back to the widest one it does. */
+void setIsaLevelSSE(IsaLevel const level);
+
+//! Get the instruction set used by the VRD kernels
+IsaLevel getIsaLevelSSE();
+
+//! Set the number of directions sampled by calculateGradientSSE() and calculateRidgeSSE() (and so by vrd_sse())
+/*! Each direction count has its own kernels, so the loops over the directions are unrolled at compile time. 4
+ *  directions sample half as many points as 8 and suit a quick preview. 16 resolve the edge orientation more finely.
+ *
+ *  \param[in] numDirections 4, 8 or 16. The default is 8, and other values are ignored with a warning. */
+void setNumDirectionsSSE(int const numDirections);
+
+//! Get the number of directions sampled by the gradient and ridge stages
+int getNumDirectionsSSE();
+
+//! Enable the gradient and ridge kernels specialized for the common radii
+/*! The radii listed in VRD_SPECIALIZED_RADII (2, 3, 5 and 8 unless the library is built with another list) have
+ *  kernels with their sample offsets fixed at compile time. They give the same results as the generic kernels, so
+ *  this switch is only useful for benchmarking.
+ *
+ *  \param[in] enabled Whether to use the specialized kernels. The default is true. */
+void setRadiusSpecializationSSE(bool const enabled);
+
+//! Get whether the gradient and ridge kernels specialized for the common radii are enabled
+bool getRadiusSpecializationSSE();
+
+//! Skip the gradient and ridge stages of vrd_sse() on flat tiles of rows
+/*! After the blur, vrd_sse() checks each tile of 16 rows of the edge map. A tile is flat when the blurred values of all
+ *  the rows it depends on, 2r rows above and below it, span no more than threshold. Flat tiles skip the gradient and
+ *  ridge stages and are filled with 128, the edge map value where the blurred image is constant. With a threshold of
+ *  0 only constant regions are skipped and the edge map is unchanged. Larger thresholds also skip regions of small
+ *  variance, such as sky or plain backgrounds, and change their edge map by an amount that grows with the threshold.
+ *  This applies to every overload of vrd_sse() and vrd_rgb_sse() except the ones that return the gradients, and to
+ *  vrd_sse_multi(), vrd_sse_batch() and VrdPipeline.
+ *
+ *  The Rolling engine blurs a constant region to exactly 0. The integral image engines leave the rounding error of
+ *  their large sums there instead, tens of units on a 640x480 image with the IntegralImage engine, so they need a
+ *  threshold above that error before any tile is skipped.
+ *
+ *  \param[in] enabled Whether to skip flat tiles. The default is false.
+ *  \param[in] threshold The largest span of blurred values that counts as flat */
+void setFlatSkipSSE(bool const enabled, float const threshold = 0.0f);
+
+//! Get whether flat tiles are skipped
+bool getFlatSkipSSE();
 
+//! Get the fraction of tiles whose gradient and ridge stages were skipped by the last edge map computed on this thread
+/*! This only covers edge maps that the calling thread computed itself. The frames of a VrdPipeline and the images
+ *  that vrd_sse_batch() hands to other threads report their own fractions instead, and VrdContext::flatSkippedFraction()
+ *  gives that of the last edge map computed with a context. */
+float getFlatSkippedFractionSSE();